@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
@@ -10,24 +12,37 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
 #include <sys/sysinfo.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <math.h>
 
 #include "util.h"
 #include "bios.h"
 
+/* Older glibc does not name the thread id of SIGEV_THREAD_ID */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /*
 	Implementation of bios.h API
 
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
-	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- One POSIX timer per core thread, which signals the core thread 
+	directly with SIGTIMER when it expires.
+	- Core threads mask all signals except for USR1 and SIGTIMER.
+	- The PIC thread receives the other signals and the device events, 
+	and dispatches them to the right core thread by raising SIGUSR1.
 
  */
 
@@ -38,11 +53,12 @@
 
 
 /*
-	Per-core data.
+	Per-core data. Each core is aligned to a cache line, since other 
+	cores write to its pending interrupts and its halt futex.
  */
 typedef struct core
 {
-	uint id;
+	_Alignas(CACHE_LINE_SIZE) uint id;
 	interrupt_handler* bootfunc;
 	pthread_t thread;
 
@@ -52,6 +68,12 @@ typedef struct core
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	/* The halt futex: 1 while the core is halted, 0 otherwise */
+	volatile uint32_t halted;
+
+	/* In virtual time, the virtual time when the core timer expires, or 0 */
+	volatile TimerDuration vdeadline;
+
 
 #if defined(CORE_STATISTICS)
 	/* Statistics */
@@ -62,6 +84,16 @@ typedef struct core
 	volatile uintptr_t rst_count;
 	volatile TimerDuration hlt_time;
 	volatile TimerDuration run_time;
+
+	/* ALARM delivery latency, from timer expiry to dispatch, in nsec */
+	uint64_t alarm_due;
+	uintptr_t alarm_count;
+	double alarm_lat_sum, alarm_lat_sumsq, alarm_lat_max;
+
+	/* Restart latency, from the wakeup of a halted core until it runs, in nsec */
+	volatile uint64_t rst_stamp;
+	uintptr_t rst_lat_count;
+	double rst_lat_sum, rst_lat_max;
 #endif
 
 } Core;
@@ -73,8 +105,11 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
+/* The signal of the core timers, a real-time signal so that it is not merged with SIGUSR1 */
+static int SIGTIMER;
+
+/* Used to store the set of SIGUSR1 and SIGTIMER, which a halted core waits for */
+static sigset_t interrupt_set;
 
 /* Used to create the signalfd */
 static sigset_t signalfd_set;
@@ -91,8 +126,8 @@ static pthread_barrier_t system_barrier, core_barrier;
 /* Flag that signals that PIC daemon should be active */
 static volatile sig_atomic_t PIC_active;
 
-/* Bit vector denoting halted cores */
-static _Atomic uint32_t halt_vector;
+/* Bitmap denoting halted cores */
+static uint64_t halt_vector[BITMAP_WORDS(MAX_CORES)];
 
 /* PIC thread id */
 static pthread_t PIC_thread;
@@ -103,46 +138,79 @@ static struct sigaction USR1_saved_sigaction;
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
+/* Save the sigaction for SIGTIMER */
+static struct sigaction TIMER_saved_sigaction;
+
+/* The sigaction for SIGTIMER (core timers) */
+static struct sigaction TIMER_sigaction;
+
 /* This gives a rough serial port timeout of 300 msec */
 #define SERIAL_TIMEOUT 300000
 
-/* Forward decl. of per-core signal handler */
+/* Forward decl. of per-core signal handlers */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
+static void sigtimer_handler(int signo, siginfo_t* si, void* ctx);
+
+/* Forward decl. of the clock calibration */
+static void clock_initialize();
+
+/* Forward decl. of the virtual time handling of the core timer */
+static void vtime_timer_expired(Core* core);
+
+/* Set when the VM runs in virtual time (see vm_config) */
+static int vtime_mode;
 
 /* PIC daemon statistics */
 static unsigned long PIC_loops;
 
-/* Physical cores (needed for some heuristics) */
+/* Host processors that we may run on (needed for some heuristics) */
 static unsigned int physical_cores;
 
+/* The host processors in our affinity mask, which taskset or a cpuset may restrict */
+static unsigned int usable_processors()
+{
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return get_nprocs();
+	return CPU_COUNT(&allowed);
+}
+
 
 /* Initialize static vars. This is called via pthread_once() */
 static pthread_once_t init_control = PTHREAD_ONCE_INIT;
 static void initialize()
 {
-	physical_cores = get_nprocs();
+	physical_cores = usable_processors();
+	clock_initialize();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* SIGUSR1 is not blocked in the handler, intr_disabled guards it instead */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
-	/* Create the sigmask to block all signals, except USR1 */
+	SIGTIMER = SIGRTMIN;
+	TIMER_sigaction.sa_sigaction = sigtimer_handler;
+	TIMER_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(& TIMER_sigaction.sa_mask);
+
+	/* Create the sigmask to block all signals, except USR1 and SIGTIMER */
 	CHECK(sigfillset(&core_signal_set));
 	CHECK(sigdelset(&core_signal_set, SIGUSR1));
+	CHECK(sigdelset(&core_signal_set, SIGTIMER));
 
 	/* Create the mask for blocking SIGUSR1 */
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
+	/* Create the mask for blocking core interrupts */
+	CHECK(sigemptyset(&interrupt_set));
+	CHECK(sigaddset(&interrupt_set, SIGUSR1));
+	CHECK(sigaddset(&interrupt_set, SIGTIMER));
 
 
 	/* Create signaldf_set */
 	CHECK(sigemptyset(&signalfd_set));
 	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
 }
 
 
@@ -156,10 +224,45 @@ static inline Core* curr_core() {
 	return CORE+cpu_core_id;
 }
 
+#if defined(CORE_STATISTICS)
+/* The host monotonic clock in nsec, for statistics */
+static inline uint64_t get_precise_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec + curtime.tv_sec*1000000000ull;
+}
+
+/* Account the latency of an ALARM, if the timer was set to expire */
+static void alarm_latency(Core* core)
+{
+	if(core->alarm_due == 0) return;
+	double lat = (double)get_precise_time() - (double)core->alarm_due;
+	core->alarm_due = 0;
+	core->alarm_count++;
+	core->alarm_lat_sum += lat;
+	core->alarm_lat_sumsq += lat*lat;
+	if(lat > core->alarm_lat_max) core->alarm_lat_max = lat;
+}
+#endif
 
 /*
-	Cause PIC daemon to loop. This needs to happen when we wish 
-	the PIC daemon to refresh the list of fds it is polling.
+	The interrupt-disable flag of the core.
+
+	Interrupts are disabled in software: SIGUSR1 stays unblocked, and the
+	signal handler returns at once if this flag is set, leaving the
+	interrupt pending in Core.intr_pending. cpu_enable_interrupts() then 
+	dispatches it. Thus, disabling and enabling interrupts costs no 
+	system call. The flag is also set while interrupt handlers run.
+*/
+static _Thread_local volatile sig_atomic_t intr_disabled;
+
+/* Keep the compiler from moving memory accesses across a change of intr_disabled */
+#define intr_barrier()  __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+
+/*
+	Cause PIC daemon to loop. This is needed to stop it.
  */
 static inline void interrupt_pic_thread()
 {
@@ -180,6 +283,8 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	core->halted = 0;
+	core->vdeadline = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -190,10 +295,11 @@ static void* core_thread(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
+	/* create a thread-specific timer, that signals this thread */
+	core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+	core->timer_sigevent.sigev_signo = SIGTIMER;
 	core->timer_sigevent.sigev_value.sival_int = core->id;
+	core->timer_sigevent.sigev_notify_thread_id = syscall(SYS_gettid);
 	// Could also be CLOCK_REALTIME
 	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
 
@@ -232,7 +338,7 @@ static void* core_thread(void* _core)
 static inline int intr_fetch_set(Core* core, Interrupt intno)
 {
 	uint32_t sel = 1<<intno;
-	uint32_t old = __atomic_fetch_or(& core->intr_pending, sel, __ATOMIC_ACQ_REL);
+	uint32_t old = __atomic_fetch_or(& core->intr_pending, sel, __ATOMIC_SEQ_CST);
 	return (old & sel) != 0;
 }
 
@@ -273,13 +379,67 @@ static inline int intr_fetch_lowest(Core* core, Interrupt* intp)
 }
 
 
+/*
+	Halting and restarting a core.
+
+	A halted core sleeps on its halt futex, core->halted, which is 1 while
+	the core is halted. To restart the core, it suffices to flip the futex 
+	from 1 to 0 and wake it; no signal is involved. Only the thread that 
+	flips the futex issues the wakeup.
+
+	A halting core sets core->halted and then checks for pending 
+	interrupts, while a raiser sets the pending interrupt and then 
+	checks core->halted. Both are sequentially consistent, so at least 
+	one of them sees the other: either the core does not sleep, or the 
+	raiser wakes it.
+
+	The signal handlers of the core, which may run just before the core 
+	sleeps on the futex, clear core->halted themselves, so that the 
+	futex wait returns at once.
+ */
+static inline void futex_wait(volatile uint32_t* addr, uint32_t val)
+{
+	int rc = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+	assert(rc==0 || errno==EAGAIN || errno==EINTR);
+	(void)rc;
+}
+
+static inline void futex_wake(volatile uint32_t* addr)
+{
+	CHECK(syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0));
+}
+
+/* Flip the halt futex from 1 to 0. Return 1 if this call did so. */
+static inline int core_unhalt(Core* core)
+{
+	uint32_t one = 1;
+	return __atomic_compare_exchange_n(& core->halted, &one, 0, 0, 
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Wake up a halted core, return 1 if it was halted */
+static int core_wakeup(Core* core)
+{
+	if(! core_unhalt(core)) return 0;
+
+#if defined(CORE_STATISTICS)
+	core->rst_stamp = get_precise_time();
+#endif
+	futex_wake(& core->halted);
+	return 1;
+}
+
+
 /* 
 	Cause the given core to be interrupted in the future.
 	This function does not add a pending interrupt, but
-	causes a signal to be sent to the core.
+	causes the core to notice its pending interrupts: a halted
+	core is woken up, and a running core is sent a signal.
  */
 static inline void interrupt_core(Core* core)
 {
+	if(core_wakeup(core)) return;
+
 	union sigval coreval;
 	coreval.sival_ptr = NULL; /* This is to silence valgrind */
 	coreval.sival_int = core->id;	
@@ -325,8 +485,15 @@ static inline void dispatch_interrupts(Core* core)
 		assert(0 <= irq  && irq < maximum_interrupt_no);
 #if defined(CORE_STATISTICS)
 		core->irq_delivered[irq]++;
+		if(irq==ALARM) alarm_latency(core);
 #endif
 		interrupt_handler* handler =  core->intvec[irq];
+
+		/* 
+			The handler may switch contexts, leaving this loop suspended
+			on the stack of the preempted thread. Interrupts still pending 
+			are then dispatched when the new context enables interrupts.
+		*/
 		if(handler != NULL) handler();
 	
 		/* 
@@ -343,17 +510,58 @@ static inline void dispatch_interrupts(Core* core)
 
 
 /*
-	This is the signal handler for core threads, to handle interrupts.
+	Dispatch the pending interrupts from a signal handler, unless 
+	interrupts are disabled; then, they will be dispatched when enabled.
  */
-static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
+static inline void handle_interrupts(Core* core)
 {
-	Core* core = & CORE[si->si_value.sival_int];
-
 #if defined(CORE_STATISTICS)
 	core->irq_count++;
 #endif
 
+	if(intr_disabled) {
+		/* The core may be about to halt, do not let it sleep */
+		core_unhalt(core);
+		return;
+	}
+
+	intr_disabled = 1;
+	intr_barrier();
 	dispatch_interrupts(core);
+	intr_barrier();
+	intr_disabled = 0;
+}
+
+/*
+	Mark ALARM pending, when the core timer has expired. No signal is 
+	needed, we are on the core already.
+ */
+static inline void raise_alarm(Core* core)
+{
+	if(! intr_fetch_set(core, ALARM) ) {
+#if defined(CORE_STATISTICS)
+		core->irq_raised[ALARM] ++;
+#endif
+	}
+}
+
+/*
+	This is the signal handler for core threads, to handle interrupts.
+ */
+static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
+{
+	handle_interrupts(& CORE[si->si_value.sival_int]);
+}
+
+/*
+	This is the signal handler of the core timer.
+ */
+static void sigtimer_handler(int signo, siginfo_t* si, void* ctx)
+{
+	Core* core = & CORE[si->si_value.sival_int];
+	if(vtime_mode) vtime_timer_expired(core);
+	raise_alarm(core);
+	handle_interrupts(core);
 }
 
 
@@ -362,12 +570,305 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
  */
 
 
-/* Coarse clock */
-static TimerDuration get_coarse_time()
+/*
+	Monotonic clock, in usec. 
+
+	The clock is CLOCK_MONOTONIC of the host. On Linux, clock_gettime() 
+	is served by the vDSO without entering the kernel. 
+
+	On x86-64, when the host kernel itself keeps time with the TSC (that 
+	is, it has found the TSC to be invariant and synchronized across cpus), 
+	the clock is read from the TSC directly, which is a few times cheaper.
+	For the first TSC_CALIBRATION nsec the clock is CLOCK_MONOTONIC, while 
+	the TSC rate is measured. After that, the TSC clock is anchored to 
+	CLOCK_MONOTONIC, and it is re-anchored every TSC_REANCHOR nsec, with the 
+	rate measured over the whole time since startup, so that it does not 
+	drift away from the host clock (see tsc_reanchor()).
+ */
+
+static inline uint64_t get_monotonic_nsec()
 {
 	struct timespec curtime;
-	CHECK(clock_gettime(CLOCK_REALTIME_COARSE, &curtime));
-	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec + curtime.tv_sec*1000000000ull;
+}
+
+static inline TimerDuration get_monotonic_clock()
+{
+	return get_monotonic_nsec() / 1000ull;
+}
+
+#if defined(__x86_64__)
+
+/* TSC calibration period, and re-anchoring period, in nsec */
+#define TSC_CALIBRATION 50000000ull
+#define TSC_REANCHOR 1000000000ull
+
+/* 
+	A clock that is behind by this many nsec or more is stepped forward at 
+	re-anchoring, and smaller errors are slewed away. A clock that is ahead 
+	is never stepped back: it is slewed, at no less than half the rate.
+ */
+#define TSC_MAX_SLEW 1000000ll
+
+/* When tsc_clock is 0, the TSC is not used */
+static int tsc_clock;
+
+/* The start of the calibration */
+static uint64_t tsc_cal;
+static uint64_t tsc_cal_nsec;
+
+/* 
+	The anchor of the TSC clock: the clock reads nsec + (rdtsc()-tsc)*mult/2^32, 
+	until the TSC reaches next. While mult is 0, the clock is not calibrated yet.
+
+	The anchor is double-buffered under a sequence lock. tsc_seq is odd 
+	while a writer fills the spare anchor, and the current one is 
+	tsc_anchor[(tsc_seq/2) % 2]. A reader that finds a writer at work, 
+	maybe the thread that it interrupted, still reads the current anchor.
+ */
+typedef struct { uint64_t tsc, nsec, mult, next; } tsc_anchor_t;
+static unsigned tsc_seq;
+static tsc_anchor_t tsc_anchor[2];
+
+static inline uint64_t rdtsc()
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Number of tries of tsc_sample(); the tightest one is kept */
+#define TSC_SAMPLES 5
+
+/* Sample the TSC and the monotonic clock together */
+static void tsc_sample(uint64_t* tsc, uint64_t* nsec)
+{
+	uint64_t best = ~(uint64_t)0;
+	for(int i=0; i<TSC_SAMPLES; i++) {
+		uint64_t t0 = rdtsc();
+		uint64_t ns = get_monotonic_nsec();
+		uint64_t t1 = rdtsc();
+		if(t1-t0 < best) {
+			best = t1-t0;
+			*tsc = t0 + (t1-t0)/2;
+			*nsec = ns;
+		}
+	}
+}
+
+/* Return true if the host kernel uses the TSC as its clocksource */
+static int host_clocksource_is_tsc()
+{
+	char buf[16] = { 0 };
+	FILE* f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+	if(f == NULL) return 0;
+	int ok = fgets(buf, sizeof(buf), f) != NULL && strcmp(buf, "tsc\n") == 0;
+	fclose(f);
+	return ok;
+}
+
+static void clock_initialize()
+{
+	if(! host_clocksource_is_tsc()) return;
+	tsc_sample(&tsc_cal, &tsc_cal_nsec);
+	tsc_clock = 1;
+}
+
+/* The TSC clock at tsc, by the given anchor */
+static inline uint64_t tsc_nsec(uint64_t tsc, uint64_t base, uint64_t nsec, uint64_t mult)
+{
+	return nsec + (uint64_t)(((unsigned __int128)(tsc - base) * mult) >> 32);
+}
+
+/*
+	Anchor the TSC clock to CLOCK_MONOTONIC, if no other thread is doing it,
+	and return the clock in nsec. The caller passes the anchor a that it read
+	at an even sequence seq, and the TSC value that it read.
+
+	The rate is measured from the start of the calibration, so it gets 
+	more accurate with time. The clock is continuous: it continues from the 
+	value of the old anchor, and the error against CLOCK_MONOTONIC is slewed 
+	away over the next TSC_REANCHOR nsec (see TSC_MAX_SLEW).
+ */
+static uint64_t __attribute__((noinline)) 
+tsc_reanchor(unsigned seq, uint64_t tsc0, const tsc_anchor_t* a)
+{
+	/* Still calibrating, or another thread is at it */
+	if(a->mult == 0) {
+		uint64_t nsec = get_monotonic_nsec();
+		if(nsec - tsc_cal_nsec < TSC_CALIBRATION 
+			|| ! __atomic_compare_exchange_n(&tsc_seq, &seq, seq+1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return nsec;
+	}
+	else if(! __atomic_compare_exchange_n(&tsc_seq, &seq, seq+1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return tsc_nsec(tsc0, a->tsc, a->nsec, a->mult);
+
+	uint64_t tsc, nsec;
+	tsc_sample(&tsc, &nsec);
+
+	/* The TSC must have advanced, else we do not trust it */
+	if(tsc <= tsc_cal) {
+		tsc_clock = 0;
+		__atomic_store_n(&tsc_seq, seq+2, __ATOMIC_RELEASE);
+		return nsec;
+	}
+
+	uint64_t rate = ((unsigned __int128)(nsec - tsc_cal_nsec) << 32) / (tsc - tsc_cal);
+	uint64_t period = ((unsigned __int128)TSC_REANCHOR << 32) / rate;
+	uint64_t newbase = nsec;
+	uint64_t newmult = rate;
+
+	if(a->mult != 0) {
+		uint64_t now = tsc_nsec(tsc, a->tsc, a->nsec, a->mult);
+		int64_t err = (int64_t)(nsec - now);
+		if(err < TSC_MAX_SLEW) {
+			if(err < -(int64_t)TSC_REANCHOR/2)
+				err = -(int64_t)TSC_REANCHOR/2;
+			newbase = now;
+			newmult = ((unsigned __int128)(TSC_REANCHOR + err) << 32) / period;
+		}
+	}
+
+	tsc_anchor_t* spare = &tsc_anchor[(seq/2 + 1) % 2];
+	__atomic_store_n(&spare->tsc, tsc, __ATOMIC_RELAXED);
+	__atomic_store_n(&spare->nsec, newbase, __ATOMIC_RELAXED);
+	__atomic_store_n(&spare->mult, newmult, __ATOMIC_RELAXED);
+	__atomic_store_n(&spare->next, tsc + period, __ATOMIC_RELAXED);
+	__atomic_store_n(&tsc_seq, seq+2, __ATOMIC_RELEASE);
+	return newbase;
+}
+
+static inline TimerDuration get_clock()
+{
+	if(! tsc_clock)
+		return get_monotonic_clock();
+
+	for(;;) {
+		unsigned seq = __atomic_load_n(&tsc_seq, __ATOMIC_ACQUIRE);
+		const tsc_anchor_t* cur = &tsc_anchor[(seq/2) % 2];
+
+		uint64_t tsc = rdtsc();
+		tsc_anchor_t a;
+		a.tsc = __atomic_load_n(&cur->tsc, __ATOMIC_RELAXED);
+		a.nsec = __atomic_load_n(&cur->nsec, __ATOMIC_RELAXED);
+		a.mult = __atomic_load_n(&cur->mult, __ATOMIC_RELAXED);
+		a.next = __atomic_load_n(&cur->next, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* The anchor is intact, unless a later writer has started to refill it */
+		if(__atomic_load_n(&tsc_seq, __ATOMIC_RELAXED) - (seq & ~1u) > 2)
+			continue;
+
+		if(__builtin_expect(tsc < a.next, 1))
+			return tsc_nsec(tsc, a.tsc, a.nsec, a.mult) / 1000ull;
+
+		/* Time to re-anchor, or still calibrating */
+		if(! (seq & 1))
+			return tsc_reanchor(seq, tsc, &a) / 1000ull;
+		if(a.mult == 0)
+			return get_monotonic_clock();
+		return tsc_nsec(tsc, a.tsc, a.nsec, a.mult) / 1000ull;
+	}
+}
+
+#else
+
+static void clock_initialize() { }
+
+static inline TimerDuration get_clock()
+{
+	return get_monotonic_clock();
+}
+
+#endif
+
+
+
+/*
+	Virtual time.
+
+	In virtual time, bios_clock() returns the host clock plus an offset,
+	and the offset grows whenever all cores are idle: the last core to halt 
+	(with no interrupt pending anywhere) fast-forwards the clock to the 
+	earliest expiry of a core timer, and raises ALARM to the cores whose 
+	timers have expired. Thus, idle periods take no time at all, and
+	timeouts expire in an order and at times that do not depend on how
+	quickly the host wakes up threads.
+
+	While some core runs, virtual time advances with the host clock, so
+	the POSIX core timers still expire at the right virtual time. The 
+	virtual expiry of each core timer is kept in Core.vdeadline, and 
+	after a fast-forward the timers that are still pending are re-armed 
+	for their remaining virtual time.
+ */
+
+/* The virtual clock minus the host clock, in usec */
+static TimerDuration vtime_offset;
+
+/* The number of halted cores */
+static uint vtime_idle;
+
+/* Serializes changes to the core timers with the fast-forward */
+static pthread_mutex_t vtime_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline TimerDuration get_vclock()
+{
+	return get_clock() + __atomic_load_n(& vtime_offset, __ATOMIC_ACQUIRE);
+}
+
+/* Arm the POSIX timer of a core, return the old setting */
+static void core_timer_settime(Core* core, TimerDuration usec, struct itimerspec* oldtime)
+{
+	struct itimerspec newtime = {
+		.it_value = {.tv_sec = usec / 1000000, .tv_nsec = (usec % 1000000) * 1000ull},
+		.it_interval = {.tv_sec=0, .tv_nsec=0}
+	};
+	CHECK(timer_settime(core->timer_id, 0, &newtime, oldtime));
+}
+
+/* Called by the timer signal handler: forget the virtual deadline, if it has passed */
+static void vtime_timer_expired(Core* core)
+{
+	TimerDuration vd = core->vdeadline;
+	if(vd != 0 && vd <= get_vclock())
+		core->vdeadline = 0;
+}
+
+/* Fast-forward the clock, if all cores are idle, and expire the due timers */
+static void vtime_advance()
+{
+	CHECKRC(pthread_mutex_lock(& vtime_lock));
+
+	for(uint c=0; c<ncores; c++)
+		if(! CORE[c].halted || CORE[c].intr_pending) goto done;
+
+	TimerDuration now = get_vclock(), next = 0;
+	for(uint c=0; c<ncores; c++) {
+		TimerDuration vd = CORE[c].vdeadline;
+		if(vd != 0 && (next == 0 || vd < next)) next = vd;
+	}
+	if(next == 0) goto done;
+
+	if(next > now) {
+		__atomic_add_fetch(& vtime_offset, next - now, __ATOMIC_RELEASE);
+		now = next;
+	}
+
+	for(uint c=0; c<ncores; c++) {
+		Core* core = & CORE[c];
+		if(core->vdeadline == 0) continue;
+		if(core->vdeadline <= now) {
+			core->vdeadline = 0;
+			core_timer_settime(core, 0, NULL);
+			raise_interrupt(core, ALARM);
+		}
+		else
+			core_timer_settime(core, core->vdeadline - now, NULL);
+	}
+
+done:
+	CHECKRC(pthread_mutex_unlock(& vtime_lock));
 }
 
 
@@ -413,10 +914,68 @@ typedef struct io_device
 
 	Core* volatile int_core;	/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
+	volatile int hungup;		/* the peer hung up, the device is not armed */
 	TimerDuration last_int;	    /* used by PIC for timeouts */
+
+	/* Interrupt coalescing, see bios_serial_coalesce() */
+	volatile uint coal_bytes;			/* bytes that must be ready for an interrupt */
+	volatile TimerDuration coal_delay;	/* max delay of an interrupt */
+	TimerDuration coal_since;	/* when the deferred interrupt became due, or 0 */
+
+#if defined(CORE_STATISTICS)
+	uintptr_t ev_count;			/* readiness events seen by the PIC */
+	uintptr_t irq_count;		/* interrupts raised for them */
+#endif
 } io_device;
 
 
+/* The epoll instance of the PIC daemon, where the io_devices are registered */
+static int PIC_epfd = -1;
+
+/*
+	The epoll event for a device. It is one-shot: after it is reported, 
+	the PIC does not watch the device until it is armed again.
+ */
+static inline struct epoll_event io_device_event(io_device* dev)
+{
+	struct epoll_event ev;
+	ev.events = ((dev->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT) | EPOLLET | EPOLLONESHOT;
+	ev.data.ptr = dev;
+	return ev;
+}
+
+/*
+	Ask the PIC to report when the device becomes ready. If the device is
+	ready already (e.g., data arrived after a read failed), the event is
+	reported at once.
+
+	A device whose peer hung up is not armed, since it would be reported 
+	at once, again and again. It only gets the interrupts of the 
+	SERIAL_TIMEOUT scan, until a read or write succeeds again (e.g., the
+	peer reopened the fifo).
+ */
+static void io_device_arm(io_device* dev)
+{
+	struct epoll_event ev = io_device_event(dev);
+	CHECK(epoll_ctl(PIC_epfd, EPOLL_CTL_MOD, dev->fd, &ev));
+}
+
+/*
+	Return how many bytes are ready: for RX the bytes that can be read, 
+	for TX the room that is free. If this cannot be found, return UINT_MAX.
+ */
+static uint io_device_level(io_device* dev)
+{
+	int queued;
+	if(ioctl(dev->fd, FIONREAD, &queued) == -1) return UINT_MAX;
+	if(dev->iodir == IODIR_RX) return queued;
+
+	int size = fcntl(dev->fd, F_GETPIPE_SZ);
+	if(size == -1) return UINT_MAX;
+	return (size > queued) ? size - queued : 0;
+}
+
+
 /*
 	Determine device readiness without blocking
  */
@@ -430,22 +989,6 @@ static int io_device_ready(int fd, io_direction dir) {
 }
 
 
-/*
-	Check that the a device is connected and in a good state.
- */
-static int io_device_check(io_device* dev)
-{
-	struct pollfd fds = { .fd=dev->fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	rc = (fds.revents & (POLLHUP|POLLERR))==0;
-	assert(rc);
-	return rc;
-}
-
-
-
 /*
 	Initialize device
  */
@@ -455,7 +998,15 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
 	this->iodir = iodir;
 	this->int_core = &CORE[0];
 	this->ready = io_device_ready(fd, iodir);
-	this->last_int = get_coarse_time();
+	this->hungup = 0;
+	this->last_int = get_clock();
+	this->coal_bytes = 0;
+	this->coal_delay = 0;
+	this->coal_since = 0;
+#if defined(CORE_STATISTICS)
+	this->ev_count = 0;
+	this->irq_count = 0;
+#endif
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
@@ -473,42 +1024,60 @@ static int io_device_destroy(io_device* this)
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Read up to size bytes from the device, return the number of bytes read.
+	When no bytes can be read, the device becomes NOT READY.
+ */
+static unsigned int io_device_read(io_device* this, char* buf, unsigned int size)
 {
 	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
+	ssize_t rc;
+	while((rc=read(this->fd, buf, size))==-1 && errno == EINTR);
 
-	int ok = rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
+	int ok = rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
 	if(!ok) perror("io_device_read:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
+	if(rc>0)
+		this->hungup = 0;
+	else if(rc==0)
+		this->hungup = 1;	/* end of file */
+
+	if(rc<=0 && this->ready) {
 		this->ready = 0;
-		interrupt_pic_thread();
+		if(! this->hungup) io_device_arm(this);
 	}
-	return rc==1;
+	return (rc>0) ? rc : 0;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Write up to size bytes to the device, return the number of bytes written.
+	When no bytes can be written, the device becomes NOT READY.
+ */
+static unsigned int io_device_write(io_device* this, const char* buf, unsigned int size)
 {
 	assert(this->iodir == IODIR_TX);
 
 	/* Try to write */
-	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	ssize_t rc;
+	while((rc = write(this->fd, buf, size))==-1 && errno == EINTR);
 
-	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
+	int ok = rc>0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
 	if(! ok) perror("io_device_write:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
+	if(rc>0)
+		this->hungup = 0;
+	else if(rc==-1 && errno == EPIPE)
+		this->hungup = 1;	/* the reader closed */
+
+	if(rc<=0 && this->ready) {
 		this->ready = 0;
-		interrupt_pic_thread();
+		if(! this->hungup) io_device_arm(this);
 	} 
 
-	return rc==1;
+	return (rc>0) ? rc : 0;
 }
 
 
@@ -563,19 +1132,29 @@ static int terminal_destroy(terminal* this)
 	Implementation:
 	- Use Linux signal file descriptors to receive signals. Currently,
 	  two signals are used:
-	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
+	  * SIGUSR1 is sent to stop the PIC daemon. Otherwise it is discarded.
 
-	  * SIGALRM is sent to indicate that some core timer has expired. This
-	    results to an interrupt on the core.
+	  The core timers do not pass through the PIC: they signal their core 
+	  with SIGTIMER directly.
 
-	- Monitor these fds together with the fds of the terminals.
+	- Monitor this fd together with the fds of the terminals, in an
+	  epoll instance. The registrations persist across loops. A device 
+	  is registered edge-triggered and one-shot: when an io_device 
+	  becomes NOT READY, the core that found it so re-arms it with
+	  epoll_ctl(), without waking up the PIC daemon. Thus, the work per 
+	  loop depends on the events, not on the number of devices.
 	
-	- At each loop dispatch interrupts as needed:
-	  * ALARM interrupts to those cores whose timer has expired
-	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
-	    an io_device which is now READY.		
+	- At each loop dispatch SERIAL_RX/TX_READY to those cores handling 
+	  the interrupts of an io_device which is now READY.		
+	  Every SERIAL_TIMEOUT, the devices that have not had an interrupt 
+	  for that long get one.
+
+	- A device with interrupt coalescing (see bios_serial_coalesce()) 
+	  gets its interrupt at once only if enough bytes are ready. Else,
+	  the interrupt is deferred. The device stays disarmed meanwhile
+	  (no core re-arms it, since it is not READY), so more data wake up 
+	  neither the PIC nor a core. A timerfd, also in the epoll instance,
+	  expires at the earliest deadline of the deferred interrupts.
  */
 
 
@@ -621,92 +1200,101 @@ static void close_signalfd(int sfd)
 
 /********************************
 
-	PIC loop state and helpers
+	PIC loop helpers
 
  ********************************/
 
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
-
+/* The maximum number of events handled per loop */
+#define PIC_EVENTS 64
 
-static void pic_selector_reset(pic_selector* ps)
+static inline void pic_add_fd(int fd, uint32_t events, void* data)
 {
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = data;
+	CHECK(epoll_ctl(PIC_epfd, EPOLL_CTL_ADD, fd, &ev));
 }
 
-
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
+static inline void pic_add_io_device(io_device* dev)
 {
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
+	struct epoll_event ev = io_device_event(dev);
+	CHECK(epoll_ctl(PIC_epfd, EPOLL_CTL_ADD, dev->fd, &ev));
 }
 
-
-
-static int pic_select(pic_selector* ps)
+static void term_dev_raise(io_device* dev, TimerDuration system_clock)
 {
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
+	dev->ready = 1;
+	dev->last_int = system_clock;
+	dev->coal_since = 0;
+#if defined(CORE_STATISTICS)
+	dev->irq_count++;
+#endif
+	Core* core = (Core*) dev->int_core;
+	switch(dev->iodir) {
+		case IODIR_RX:
+			raise_interrupt(core, SERIAL_RX_READY); break;
+		case IODIR_TX:
+			raise_interrupt(core, SERIAL_TX_READY); break;
 	}
-	return selcode;
 }
 
-
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
+/* 
+	Handle a readiness event of a device: raise an interrupt, unless
+	coalescing defers it. Return 1 if the interrupt was deferred.
+ */
+static int term_dev_event(io_device* dev, TimerDuration system_clock)
 {
-	return FD_ISSET(fd, & ps->fds[dir]);
-}
-
-
+#if defined(CORE_STATISTICS)
+	dev->ev_count++;
+#endif
+	uint bytes = dev->coal_bytes;
+	TimerDuration delay = dev->coal_delay;
 
+	if(bytes > 1 && delay > 0) {
+		if(dev->coal_since == 0) dev->coal_since = system_clock;
+		if(io_device_level(dev) < bytes && system_clock - dev->coal_since < delay)
+			return 1;
+	}
+	term_dev_raise(dev, system_clock);
+	return 0;
+}
 
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
+/* Raise the deferred interrupt of a device, if it is due or enough bytes are ready */
+static void term_dev_raise_if_due(io_device* dev, TimerDuration system_clock)
 {
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
+	if(dev->coal_since == 0) return;
+	if(system_clock - dev->coal_since < dev->coal_delay && io_device_level(dev) < dev->coal_bytes)
+		return;
+	term_dev_raise(dev, system_clock);
 }
 
-
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
+/* Set the coalescing timer to the earliest deadline of a deferred interrupt */
+static void pic_coalesce_timer(int tfd, TimerDuration system_clock)
 {
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
+	TimerDuration deadline = 0;
+	for(uint i=0; i<nterm; i++) {
+		io_device* devs[2] = { & TERM[i].kbd, & TERM[i].con };
+		for(int d=0; d<2; d++) {
+			if(devs[d]->coal_since == 0) continue;
+			TimerDuration due = devs[d]->coal_since + devs[d]->coal_delay;
+			if(deadline == 0 || due < deadline) deadline = due;
+		}
 	}
-}
 
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	if(deadline) {
+		TimerDuration left = (deadline > system_clock) ? deadline - system_clock : 1;
+		its.it_value.tv_sec = left / 1000000;
+		its.it_value.tv_nsec = (left % 1000000) * 1000;
+	}
+	CHECK(timerfd_settime(tfd, 0, &its, NULL));
+}
 
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+/* Raise an interrupt for every device that has not had one for SERIAL_TIMEOUT */
+static void term_dev_raise_if_timeout(io_device* dev, TimerDuration system_clock)
 {
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
-		}
-	}
+	if( (system_clock - dev->last_int) > SERIAL_TIMEOUT )
+		term_dev_raise(dev, system_clock);
 }
 
 
@@ -720,67 +1308,93 @@ static void PIC_daemon(void)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	/* Open signal queues */
+	/* Open signal queue */
 	int sigusr1fd = open_signalfd(&sigusr1_set);
-	int sigalrmfd = open_signalfd(&sigalrm_set);
+
+	/* Open the coalescing timer */
+	int coalfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	CHECK(coalfd);
 
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+
+	/* Register the signal queue and the devices, before the cores start */
+	PIC_epfd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(PIC_epfd);
+	pic_add_fd(sigusr1fd, EPOLLIN, &sigusr1fd);
+	pic_add_fd(coalfd, EPOLLIN, &coalfd);
+	for(uint i=0; i<nterm; i++) {
+		pic_add_io_device(& TERM[i].kbd);
+		pic_add_io_device(& TERM[i].con);
+	}
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 	
 	/* The PIC multiplexing loop */
+	TimerDuration last_scan = get_clock();
 	while(PIC_active) {
 
-		pic_selector ps;
-
-		pic_selector_reset(&ps);
+		struct epoll_event events[PIC_EVENTS];
+		int nevents = epoll_wait(PIC_epfd, events, PIC_EVENTS, SERIAL_TIMEOUT/1000);
 
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
-
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
-
-		if(pic_select(&ps) == -1)
+		if(nevents == -1) {
+			/* An error is likely EINTR */
+			if(errno != EINTR)  perror("PIC_loops: ");
 			continue;
+		}
 
 		PIC_loops++ ;
+		TimerDuration system_clock = get_clock();
 
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
+		int deferred = 0, expired = 0;
+		for(int e=0; e<nevents; e++) {
+			void* source = events[e].data.ptr;
 
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
+			if(source == &sigusr1fd) {
+				drain_signalfd(sigusr1fd);
+			}
+			else if(source == &coalfd) {
+				uint64_t expirations;
+				while(read(coalfd, &expirations, sizeof(expirations)) == -1 && errno == EINTR);
+				expired = 1;
+			}
+			else {
+				io_device* dev = (io_device*) source;
+				if(events[e].events & (EPOLLHUP|EPOLLERR))
+					dev->hungup = 1;
+				deferred |= term_dev_event(dev, system_clock);
 			}
 		}
 
-
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
+		/* Raise the deferred interrupts that are due, and reset the timer */
+		if(expired || deferred) {
+			for(uint i=0; i<nterm; i++) {
+				term_dev_raise_if_due(& TERM[i].kbd, system_clock);
+				term_dev_raise_if_due(& TERM[i].con, system_clock);
+			}
+			pic_coalesce_timer(coalfd, system_clock);
 		}
 
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
-
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
+		if(system_clock - last_scan > SERIAL_TIMEOUT) {
+			last_scan = system_clock;
+			for(uint i=0; i<nterm; i++) {
+				term_dev_raise_if_timeout(& TERM[i].con, system_clock);
+				term_dev_raise_if_timeout(& TERM[i].kbd, system_clock);
+			}
 		}
-
-
 	}
 
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
+	/* Close the epoll instance and the signal fd */
+	CHECK(close(PIC_epfd));
+	PIC_epfd = -1;
 	close_signalfd(sigusr1fd);
-	close_signalfd(sigalrmfd);
+	CHECK(close(coalfd));
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -850,11 +1464,74 @@ int vm_config_terminals(vm_config* vmc, uint serialno, int nowait)
 }
 
 
+/* Read a topology attribute of a host cpu from sysfs, return -1 if it is not there */
+static int cpu_topology(int cpu, const char* attr)
+{
+	char fname[96];
+	snprintf(fname, sizeof(fname), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, attr);
+	FILE* f = fopen(fname, "r");
+	if(f == NULL) return -1;
+	int val;
+	if(fscanf(f, "%d", &val) != 1) val = -1;
+	fclose(f);
+	return val;
+}
+
+
+int vm_config_placement(vm_config* vmc, int pinned)
+{
+	for(uint c=0; c<MAX_CORES; c++)
+		vmc->core_cpu[c] = VM_CPU_ANY;
+	vmc->pic_cpu = VM_CPU_ANY;
+	if(! pinned) return 0;
+
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return 0;
+
+	/* 
+		Split the allowed cpus into the first hardware thread of each 
+		physical core (a package and core id pair), and the other threads.
+	 */
+	int first[CPU_SETSIZE], pkg[CPU_SETSIZE], core[CPU_SETSIZE], other[CPU_SETSIZE];
+	uint nfirst = 0, nother = 0;
+	for(int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if(! CPU_ISSET(cpu, &allowed)) continue;
+		int p = cpu_topology(cpu, "physical_package_id");
+		int k = cpu_topology(cpu, "core_id");
+
+		uint i;
+		for(i=0; i<nfirst; i++)
+			if(p != -1 && k != -1 && pkg[i] == p && core[i] == k) break;
+		if(i < nfirst)
+			other[nother++] = cpu;
+		else {
+			first[nfirst] = cpu;
+			pkg[nfirst] = p;
+			core[nfirst] = k;
+			nfirst++;
+		}
+	}
+
+	/* Do not make cores share a physical core */
+	if(vmc->cores > nfirst) return 0;
+
+	for(uint c=0; c<vmc->cores; c++)
+		vmc->core_cpu[c] = first[c];
+	if(nfirst > vmc->cores)
+		vmc->pic_cpu = first[vmc->cores];
+	else if(nother > 0)
+		vmc->pic_cpu = other[0];
+	return vmc->cores;
+}
+
+
 void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint serialno)
 {
 	vmc->bootfunc = bootfunc;
 	vmc->cores = cores;
+	vmc->virtual_time = 0;
 	CHECK(vm_config_terminals(vmc, serialno, 0));
+	vm_config_placement(vmc, 1);
 }
 
 
@@ -874,17 +1551,30 @@ void vm_run(vm_config* vmc)
 	CHECK_CONDITION(vmc->cores > 0 && vmc->cores <= MAX_CORES);
 	CHECK_CONDITION(ncores==0);
 	CHECK_CONDITION(vmc->serialno <= MAX_TERMINALS);
+	for(uint c=0; c < vmc->cores; c++)
+		CHECK_CONDITION(vmc->core_cpu[c] >= VM_CPU_ANY && vmc->core_cpu[c] < CPU_SETSIZE);
+	CHECK_CONDITION(vmc->pic_cpu >= VM_CPU_ANY && vmc->pic_cpu < CPU_SETSIZE);
 
 	/* This is called only once in the life of the process. */
 	CHECKRC(pthread_once(&init_control, initialize));
 
-	/* Install signal handler for SIGUSR1 */
+	/* Install signal handlers for SIGUSR1 and SIGTIMER */
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
+	CHECK(sigaction(SIGTIMER, &TIMER_sigaction, &TIMER_saved_sigaction));
 
 	/* Set pic_active to 1 */
 	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
+	/* Pin the PIC thread, saving its affinity */
+	cpu_set_t PIC_saved_affinity, cpuset;
+	if(vmc->pic_cpu != VM_CPU_ANY) {
+		CHECKRC(pthread_getaffinity_np(PIC_thread, sizeof(cpu_set_t), &PIC_saved_affinity));
+		CPU_ZERO(&cpuset);
+		CPU_SET(vmc->pic_cpu, &cpuset);
+		CHECKRC(pthread_setaffinity_np(PIC_thread, sizeof(cpu_set_t), &cpuset));
+	}
+
 	/* Initialize terminals */
 	nterm = vmc->serialno;
 	for(uint i=0; i<nterm; i++)
@@ -898,7 +1588,13 @@ void vm_run(vm_config* vmc)
 	pthread_barrier_init(& core_barrier, NULL, ncores);
 
 	/* Initialize the halted vector */
-	halt_vector = 0;
+	for(uint w=0; w<BITMAP_WORDS(MAX_CORES); w++)
+		halt_vector[w] = 0;
+
+	/* Initialize virtual time */
+	vtime_mode = vmc->virtual_time;
+	vtime_offset = 0;
+	vtime_idle = 0;
 
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
@@ -916,12 +1612,26 @@ void vm_run(vm_config* vmc)
 			CORE[c].hlt_count = 0;
 			CORE[c].rst_count = 0;
 			CORE[c].hlt_time = 0;
-			CORE[c].run_time = get_coarse_time();
+			CORE[c].run_time = get_clock();
 		}
+		CORE[c].alarm_due = 0;
+		CORE[c].alarm_count = 0;
+		CORE[c].alarm_lat_sum = CORE[c].alarm_lat_sumsq = CORE[c].alarm_lat_max = 0.0;
+		CORE[c].rst_stamp = 0;
+		CORE[c].rst_lat_count = 0;
+		CORE[c].rst_lat_sum = CORE[c].rst_lat_max = 0.0;
 #endif
 
-		/* Create the core thread */
-		CHECKRC(pthread_create(& CORE[c].thread, NULL, core_thread, &CORE[c]));
+		/* Create the core thread, on its host cpu */
+		pthread_attr_t attr;
+		CHECKRC(pthread_attr_init(&attr));
+		if(vmc->core_cpu[c] != VM_CPU_ANY) {
+			CPU_ZERO(&cpuset);
+			CPU_SET(vmc->core_cpu[c], &cpuset);
+			CHECKRC(pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset));
+		}
+		CHECKRC(pthread_create(& CORE[c].thread, &attr, core_thread, &CORE[c]));
+		CHECKRC(pthread_attr_destroy(&attr));
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
@@ -938,13 +1648,17 @@ void vm_run(vm_config* vmc)
 		CHECKRC(pthread_join(CORE[c].thread, NULL));
 
 #if defined(CORE_STATISTICS)
-		CORE[c].run_time = get_coarse_time() - CORE[c].run_time;
+		CORE[c].run_time = get_clock() - CORE[c].run_time;
 #endif
 	}
 
 	/* Delete the Core table */
 	ncores = 0;
 
+	/* Unpin the PIC thread */
+	if(vmc->pic_cpu != VM_CPU_ANY)
+		CHECKRC(pthread_setaffinity_np(PIC_thread, sizeof(cpu_set_t), &PIC_saved_affinity));
+
 	/* Destroy the core barrier */
 	pthread_barrier_destroy(& system_barrier);
 	pthread_barrier_destroy(& core_barrier);
@@ -956,6 +1670,7 @@ void vm_run(vm_config* vmc)
 
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
+	CHECK(sigaction(SIGTIMER, &TIMER_saved_sigaction, NULL));
 
 
 	/* print statistics */
@@ -973,8 +1688,24 @@ void vm_run(vm_config* vmc)
 		total_util += util;
 		fprintf(stderr, "  util %%: %3.2lf", util);		
 		fprintf(stderr,"\n");
+		if(CORE[c].alarm_count) {
+			double n = CORE[c].alarm_count;
+			double mean = CORE[c].alarm_lat_sum / n;
+			double var = CORE[c].alarm_lat_sumsq / n - mean*mean;
+			fprintf(stderr, "          ALARM latency usec: n=%tu mean=%.1lf jitter=%.1lf max=%.1lf\n",
+				CORE[c].alarm_count, 1E-3*mean, 1E-3*sqrt(var>0.0 ? var : 0.0), 1E-3*CORE[c].alarm_lat_max);
+		}
+		if(CORE[c].rst_lat_count) {
+			fprintf(stderr, "          restart latency usec: n=%tu mean=%.1lf max=%.1lf\n",
+				CORE[c].rst_lat_count, 1E-3*CORE[c].rst_lat_sum/CORE[c].rst_lat_count, 
+				1E-3*CORE[c].rst_lat_max);
+		}
 	}
 	fprintf(stderr,"Avg(util)=%6.2lf\n", total_util);
+	for(uint i=0; i<vmc->serialno; i++)
+		fprintf(stderr, "Terminal %u: events(irqs) kbd: %tu(%tu) con: %tu(%tu)\n", i,
+			TERM[i].kbd.ev_count, TERM[i].kbd.irq_count, 
+			TERM[i].con.ev_count, TERM[i].con.irq_count);
 #endif
 }
 
@@ -990,62 +1721,76 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_physical_cores()
+{
+	return physical_cores;
+}
+
 
 
 void cpu_core_halt()
 {
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	int enabled = cpu_disable_interrupts();
 
 	Core* core = curr_core();
-	uint32_t cmask = 1 << cpu_core_id;
+	uint64_t* hvword = & halt_vector[cpu_core_id >> 6];
+	uint64_t cmask = UINT64_C(1) << (cpu_core_id & 63);
 
 #if defined(CORE_STATISTICS)
-	TimerDuration stime0 = get_coarse_time();
+	TimerDuration stime0 = get_clock();
 #endif
 
-	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	/* Set the halt futex, then the halt bit that restart_one() looks up */
+	__atomic_store_n(& core->halted, 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_or(hvword, cmask, __ATOMIC_RELAXED);
+
+	/* In virtual time, the last core to halt fast-forwards the clock */
+	if(vtime_mode && __atomic_add_fetch(& vtime_idle, 1, __ATOMIC_ACQ_REL) == ncores)
+		vtime_advance();
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+	/* 
+		Sleep until some interrupt is pending or the core is restarted. 
+		An interrupt raised after this check clears the halt futex, 
+		so it is not missed.
+	 */
+	while(! core->intr_pending && core->halted)
+		futex_wait(& core->halted, 1);
 
-	/* Sleep for 10 msec */
-	int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-		
+	core->halted = 0;
+	__atomic_fetch_and(hvword, ~cmask, __ATOMIC_RELAXED);
+	if(vtime_mode)
+		__atomic_sub_fetch(& vtime_idle, 1, __ATOMIC_ACQ_REL);
 
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+#if defined(CORE_STATISTICS)
+	if(core->rst_stamp) {
+		double lat = (double)get_precise_time() - (double)core->rst_stamp;
+		core->rst_stamp = 0;
+		core->rst_lat_count++;
+		core->rst_lat_sum += lat;
+		if(lat > core->rst_lat_max) core->rst_lat_max = lat;
 	}
+#endif
+
+	/* Dispatch */
+	dispatch_interrupts(core);
 
 #if defined(CORE_STATISTICS)
-	/* Unset halt bit */
-	core->hlt_time += get_coarse_time()-stime0;
+	core->hlt_time += get_clock()-stime0;
 #endif
 
-	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
-
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 static int __core_restart(uint c)
 {
-	uint32_t cmask = 1 << c;
-
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
-	if( prevhv & cmask ) {
-		interrupt_core(CORE+c);
+	if(core_wakeup(CORE+c)) {
 #if defined(CORE_STATISTICS)		
 		__atomic_fetch_add(& CORE[c].rst_count, 1 , __ATOMIC_RELAXED);
 #endif
-
 		return 1;
 	} else 
 		return 0;
@@ -1061,12 +1806,17 @@ void cpu_core_restart(uint c)
 void cpu_core_restart_one()
 {
 	/* Only restart if core_id < physical_cores */
-	uint32_t hv = halt_vector;
-
-	if( (hv=halt_vector)!=0 ) {
-		uint c = __builtin_ctz(hv);
-		if(c < physical_cores)
-			__core_restart(c);
+	uint ncand = (ncores < physical_cores) ? ncores : physical_cores;
+
+	/* The halt vector is a hint, try the halted cores in order */
+	for(uint w=0; w<BITMAP_WORDS(ncand); w++) {
+		uint64_t hv = __atomic_load_n(& halt_vector[w], __ATOMIC_RELAXED);
+		while(hv != 0) {
+			uint c = w*64 + __builtin_ctzll(hv);
+			if(c >= ncand) return;
+			if(__core_restart(c)) return;
+			hv &= hv-1;
+		}
 	}
 
 }
@@ -1077,6 +1827,19 @@ void cpu_core_restart_all()
 		__core_restart(c);
 }
 
+/* How many rounds a spinning core makes before it gives up the host processor */
+#define CPU_RELAX_SPINS 128
+
+void cpu_relax()
+{
+	static _Thread_local uint spins;
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+	if(++spins % CPU_RELAX_SPINS == 0 && ncores > physical_cores)
+		sched_yield();
+}
+
 void cpu_core_barrier_sync()
 {
 	pthread_barrier_wait(& core_barrier);
@@ -1091,31 +1854,49 @@ void cpu_ici(uint core)
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
 	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &interrupt_set, &curss));
 	curr_core()->intvec[interrupt] = handler;
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! intr_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	int enabled = ! intr_disabled;
+	intr_disabled = 1;
+	intr_barrier();
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	intr_barrier();
+	intr_disabled = 0;
+	intr_barrier();
+
+	/* 
+		Dispatch the interrupts that arrived while disabled. Any interrupt
+		raised after this check comes with a signal of its own. A handler
+		may switch contexts, and we may come back on another core.
+	 */
+	Core* core;
+	while((core = curr_core())->intr_pending) {
+		intr_disabled = 1;
+		intr_barrier();
+		dispatch_interrupts(core);
+		intr_barrier();
+		intr_disabled = 0;
+		intr_barrier();
+	}
 }
 
 
+#ifdef UCONTEXT_SWITCH
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1127,8 +1908,12 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* 
+    swapcontext() installs this mask. Interrupts are masked by intr_disabled,
+    not by the signal mask, so the context gets the mask of the core threads,
+    which lets SIGUSR1 and SIGTIMER through.
+   */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1138,6 +1923,95 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#else
+
+/*
+	The x86-64 context switch.
+
+	context_switch(&oldsp, newsp) pushes the callee-saved registers of the 
+	System V ABI, together with the MXCSR and x87 control words, on the 
+	current stack, saves the stack pointer in oldsp, and pops the same frame
+	from newsp. The caller-saved registers are saved by the compiler at the
+	call, as for any function call.
+
+	A new context gets a frame that 'returns' to context_start, with the 
+	thread function in rbx. context_start calls it with the stack aligned
+	as the ABI requires; the thread function must never return.
+ */
+void context_switch(void** oldsp, void* newsp);
+void context_start(void);
+
+__asm__(
+	"	.text\n"
+	"	.p2align 4\n"
+	"	.globl context_switch\n"
+	"	.hidden context_switch\n"
+	"	.type context_switch, @function\n"
+	"context_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size context_switch, .-context_switch\n"
+	"\n"
+	"	.p2align 4\n"
+	"	.globl context_start\n"
+	"	.hidden context_start\n"
+	"	.type context_start, @function\n"
+	"context_start:\n"
+	"	callq *%rbx\n"
+	"	callq abort@PLT\n"
+	"	.size context_start, .-context_start\n"
+);
+
+/* The frame pushed by context_switch, from the stack pointer up */
+struct context_frame {
+	uint32_t mxcsr;
+	uint16_t fpucw, pad;
+	uint64_t r15, r14, r13, r12, rbx, rbp;
+	void (*ret)(void);
+};
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* context_start is entered with a 16-byte aligned stack */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	struct context_frame* frame = (struct context_frame*)top - 1;
+	assert(((uintptr_t)&frame->ret + sizeof(frame->ret)) % 16 == 0);
+
+	memset(frame, 0, sizeof(*frame));
+	frame->mxcsr = 0x1f80;		/* all exceptions masked, round to nearest */
+	frame->fpucw = 0x037f;		/* the same for x87 */
+	frame->rbx = (uint64_t)(uintptr_t) ctx_func;
+	frame->ret = context_start;
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	context_switch(&oldctx->sp, newctx->sp);
+}
+
+#endif
+
 
 
 /*
@@ -1147,17 +2021,29 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 
 TimerDuration bios_set_timer(TimerDuration usec)
 {
-	time_t sec = usec / 1000000;
-	long nsec = (usec % 1000000) * 1000ull;
-	
-	struct itimerspec newtime = {
-		.it_value = {.tv_sec=sec, .tv_nsec=nsec},
-		.it_interval = {.tv_sec=0, .tv_nsec=0}
-	};
-
+	Core* core = curr_core();
 	struct itimerspec oldtime;
 	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
+#if defined(CORE_STATISTICS)
+	core->alarm_due = usec ? get_precise_time() + 1000*usec : 0;
+#endif
+
+	if(vtime_mode) {
+		/* The ALARM handler may set the timer, so it must not interrupt us */
+		int enabled = cpu_disable_interrupts();
+		CHECKRC(pthread_mutex_lock(& vtime_lock));
+
+		TimerDuration now = get_vclock();
+		TimerDuration vd = core->vdeadline;
+		core->vdeadline = usec ? now + usec : 0;
+		core_timer_settime(core, usec, NULL);
+
+		CHECKRC(pthread_mutex_unlock(& vtime_lock));
+		if(enabled) cpu_enable_interrupts();
+		return (vd > now) ? vd - now : 0;
+	}
+
+	core_timer_settime(core, usec, &oldtime);
 
 	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
 	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
@@ -1171,7 +2057,7 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return get_coarse_time();
+	return vtime_mode ? get_vclock() : get_clock();
 }	
 
 
@@ -1201,13 +2087,27 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Set the interrupt coalescing of type 'intno' for serial port 'serial'.
+ */
+void bios_serial_coalesce(uint serial, Interrupt intno, uint bytes, TimerDuration delay)
+{
+	if(!(serial < nterm)) return;
+	if(!(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY)) return;
+
+	io_device* dev = (intno==SERIAL_RX_READY) ? & TERM[serial].kbd : & TERM[serial].con;
+	dev->coal_delay = delay;
+	dev->coal_bytes = bytes;
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& TERM[serial].kbd, ptr, 1);
 }
 
 
@@ -1217,7 +2117,27 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
+}
+
+
+/*
+	Read as many bytes as are available from serial port 'serial', up to 
+	'size', into 'buf'. Return the number of bytes read.
+ */
+unsigned int bios_read_serial_buf(uint serial, char* buf, unsigned int size)
+{
+	return io_device_read(& TERM[serial].kbd, buf, size);
+}
+
+
+/*
+	Write as many bytes of 'buf' as serial port 'serial' accepts, up to
+	'size'. Return the number of bytes written.
+ */
+unsigned int bios_write_serial_buf(uint serial, const char* buf, unsigned int size)
+{
+	return io_device_write(& TERM[serial].con, buf, size);
 }
 
 
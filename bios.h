@@ -129,7 +129,14 @@ typedef enum Interrupt
 
 
 /** @brief Maximum number of cores for a virtual machine. */
-#define MAX_CORES 32
+#define MAX_CORES 256
+
+/** @brief The size of a host cache line. 
+
+	Per-core data that are written often are aligned to this size, so that
+	cores do not contend for the same cache line (false sharing).
+*/
+#define CACHE_LINE_SIZE 64
 
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
@@ -154,6 +161,11 @@ typedef enum Interrupt
 	  (@c serial_out) file descriptor will be written to. These file descriptors
 	  should correspond to some pipe-like Linux stream (e.g., pipe, FIFO or socket).
 
+	- The host CPU that each core, and the PIC thread, is pinned to, 
+	  stored in @c core_cpu and @c pic_cpu (see @c vm_config_placement).
+
+	- Whether the VM runs in virtual time (@c virtual_time).
+
  */
 typedef struct vm_config {
 
@@ -198,9 +210,40 @@ typedef struct vm_config {
 		must be valid in this structure.
 	*/
 	int serial_out[MAX_TERMINALS];
+
+	/** @brief The host CPU that each core is pinned to.
+
+		Core @c c runs only on host CPU @c core_cpu[c], or anywhere if
+		it is @c VM_CPU_ANY. Field @c cores determines the number of 
+		valid entries.
+	*/
+	int core_cpu[MAX_CORES];
+
+	/** @brief The host CPU that the PIC thread is pinned to, or @c VM_CPU_ANY.
+
+		The PIC thread is the thread that calls @c vm_run(). It is pinned 
+		while the VM runs, and its affinity is restored when the VM shuts down.
+	*/
+	int pic_cpu;
+
+	/** @brief Run the VM in virtual time.
+
+		If non-zero, the clock of the VM (see @c bios_clock) skips ahead
+		whenever all cores are halted, to the earliest expiry of a core 
+		timer. Thus, sleeps and timeouts take no host time when the VM is 
+		idle, and their expiry order does not depend on the host. While 
+		some core runs, the clock advances with host time.
+
+		@c vm_configure sets this to 0.
+	*/
+	int virtual_time;
 } vm_config;
 
 
+/** @brief A placement that lets the host scheduler choose the CPU. */
+#define VM_CPU_ANY (-1)
+
+
 
 /**
 	@brief Initialize a VM configuration's serial ports using the terminal emulators.
@@ -222,13 +265,39 @@ typedef struct vm_config {
 int vm_config_terminals(vm_config* vmc, uint serialno, int nowait);
 
 
+/**
+	@brief Initialize the host CPU placement of a VM configuration.
+
+	If @c pinned is zero, the cores and the PIC thread are not pinned, and
+	the host scheduler is free to migrate them.
+
+	Else, the placement follows the topology of the host (as reported in 
+	@c /sys/devices/system/cpu), restricted to the CPUs that the process 
+	may run on: each core is pinned to a different physical core of the 
+	host, using the first hardware thread of each. The PIC thread is pinned
+	to the next free physical core, or else to a free hardware thread 
+	(the sibling of a core's CPU), or else it is not pinned.
+	If the host does not have a physical core for each core, pinning 
+	would make cores share CPUs, so nothing is pinned.
+
+	The field @c cores must already be set. Individual entries may be 
+	changed after this call.
+
+	@param vmc the configuration to initialize
+	@param pinned flag that the cores should be pinned
+	@return the number of pinned cores
+*/
+int vm_config_placement(vm_config* vmc, int pinned);
+
+
 /**
 	@brief Initialize a VM configuration with passed parameters.
 
 	Prepare a VM configuration with the given parameters.
 	This is a convenience function to initialize the VM configuration
 	with serial devices using the terminal emulator program provided 
-	in the distribution of @c TinyOS.
+	in the distribution of @c TinyOS, and with the default (pinned)
+	host CPU placement of @c vm_config_placement().
 
 	Note that this function will block until the terminal emulators
 	are executed.
@@ -302,6 +371,15 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Returns the number of host processors that the VM may use.
+
+	This counts the processors in the affinity mask of the process, which
+	@c taskset or a cpuset may restrict. When the VM has more cores than 
+	this, the extra cores can only run by time-sharing the host processors. 
+ */
+uint cpu_physical_cores();
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -344,7 +422,8 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	Interrupts are disabled by a per-core flag, without a system call.
+	Interrupt handlers run with interrupts disabled.
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -378,6 +457,13 @@ void cpu_enable_interrupts();
 
 	This function is useful when a core becomes idle. An idle core does not
 	consume simulation resources (in particular CPU time).
+
+	There is no implicit timeout. To bound the time spent halted, set the
+	core timer before halting; the @c ALARM interrupt will restart the core.
+	An interrupt that was raised while interrupts were disabled, just 
+	before the call, ends the halt immediately. Pending interrupts are
+	dispatched before the call returns, with interrupts disabled; the
+	interrupt status is then restored to what it was before the call.
 */
 void cpu_core_halt();
 
@@ -385,7 +471,9 @@ void cpu_core_halt();
 /**
 	@brief Restart the given core.
 
-	This call will restart the given core, if it was halted.
+	This call will restart the given core, if it was halted. The halted
+	core is woken up directly (by a futex), without any signal delivery;
+	if the core was not halted, the call has no effect.
 	@param c the core to restart
 */
 void cpu_core_restart(uint c);
@@ -404,11 +492,42 @@ void cpu_core_restart_one();
 */
 void cpu_core_restart_all();
 
+/**
+	@brief Spin-wait hint.
+
+	A core that spins, waiting for another core, should call this on every
+	round of its loop. Like the pause instruction, it eases the spinning on
+	the processor. Also, as a hypervisor would (pause-loop exiting), every
+	so often it gives up the host processor, since the core that is waited
+	for may not get to run while the extra cores time-share the host 
+	processors (see @c cpu_physical_cores()).
+ */
+void cpu_relax();
+
+
+/* The ucontext(3) functions are used where there is no assembly context switch */
+#if !defined(__x86_64__) && !defined(UCONTEXT_SWITCH)
+#define UCONTEXT_SWITCH
+#endif
 
 /**
 	@brief A type for saving CPU context into.
+
+	On x86-64, a saved context is just the stack pointer of the suspended
+	thread, whose callee-saved registers are pushed on its stack. The switch
+	does not touch the signal mask, which is the same for every thread of a 
+	core at a switch: all signals blocked, except @c SIGUSR1 as set by 
+	preemption.
+
+	If @c UCONTEXT_SWITCH is defined (by @c make @c UCONTEXT_SWITCH=1), the 
+	slower @c swapcontext(3), which saves the signal mask with a system call, 
+	is used instead.
 */
+#ifdef UCONTEXT_SWITCH
 typedef ucontext_t cpu_context_t;
+#else
+typedef struct { void* sp; } cpu_context_t;
+#endif
 
 
 /**
@@ -473,13 +592,14 @@ TimerDuration bios_cancel_timer();
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
+	This function returns a monotonic clock value, in usec, measured
+	from an arbitrary point in the past (typically, host boot).
+	The clock never jumps, not even when the host wall-clock time 
+	is changed, and it is shared by all cores.
 
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	The resolution of the clock is 1 usec, and reading it costs 
+	a few tens of nanoseconds, so it is appropriate for measuring
+	intervals and for setting timeouts and quanta well below a msec.
  */
 TimerDuration bios_clock();
 
@@ -512,6 +632,30 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Set the interrupt coalescing of a serial port.
+
+	By default, an interrupt of type @c intno is raised as soon as serial port 
+	@c serial becomes ready. Under a fast stream of data, this may mean an 
+	interrupt for every few bytes.
+
+	With coalescing, when the port becomes ready the interrupt is raised
+	at once only if at least @c bytes bytes are ready (for @c SERIAL_RX_READY, 
+	bytes that can be read; for @c SERIAL_TX_READY, room for bytes to be 
+	written). Else, it is deferred for at most @c delay usec; the data 
+	that arrive meanwhile do not cause more interrupts.
+	Coalescing is disabled if @c bytes is at most 1 or @c delay is 0.
+
+	@param serial the serial device, which must be greater or equal to 
+	         @c 0 and less than @c bios_serial_ports().
+	@param intno the interrupt (one of @c SERIAL_RX_READY and 
+			@c SERIAL_TX_READY)
+	@param bytes the number of ready bytes that raises the interrupt at once
+	@param delay the maximum time, in usec, that the interrupt is deferred
+ */
+void bios_serial_coalesce(uint serial, Interrupt intno, uint bytes, TimerDuration delay);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -546,4 +690,42 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read many bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial into @c buf, 
+	in a single transfer. As many bytes as the terminal has sent (up to 
+	@c size) are read, and their number is returned. 
+
+	If this operation returns 0, a @c SERIAL_RX_READY interrupt will be raised when
+	data is ready to be received, but the contents of @c buf will not be touched.
+
+	@param serial the serial device to read from
+	@param buf the location in which to store the read bytes
+	@param size the maximum number of bytes to read
+	@return the number of bytes read
+	@see bios_read_serial
+ */
+unsigned int bios_read_serial_buf(uint serial, char* buf, unsigned int size);
+
+
+/**
+	@brief Write many bytes to a serial port.
+
+	Try to write up to @c size bytes from @c buf to serial port @c serial, in 
+	a single transfer. As many bytes as the device accepts (up to @c size)
+	are written, and their number is returned.
+
+	If this operation returns 0, a @c SERIAL_TX_READY interrupt will be raised when
+	the device is ready to accept data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send to the serial device
+	@param size the maximum number of bytes to write
+	@return the number of bytes written
+	@see bios_write_serial
+ */
+unsigned int bios_write_serial_buf(uint serial, const char* buf, unsigned int size);
+
+
 #endif
@@ -19,45 +19,328 @@
   */
 
 
+/*
+ 	Queued spinlock.
+ 	----------------
+
+ 	An MCS lock for the non-preemptive domain. A core that locks a spinlock
+ 	appends a queue node to the lock, and spins on a flag in its own node,
+ 	until its predecessor clears it on unlock. Thus, each waiting core spins 
+ 	on a cache line of its own, instead of all cores hammering the lock word
+ 	as they would with test-and-set, and the lock passes in FIFO order.
+
+ 	Since the holder is not preempted, it does not move to another core 
+ 	before unlocking. Therefore, the nodes come from a small per-core pool,
+ 	and the lock keeps a pointer to the node of its holder, for unlocking.
+
+ 	A queued lock passes to the next waiting core in line, even if that core 
+ 	is not running. This happens when the VM has more cores than the host has 
+ 	processors, and the host time-shares them: every hand-off may then wait 
+ 	for the host to schedule a particular core. In that case, as kernels do
+ 	on hypervisors, the spinlocks fall back to test-and-set on the tail word,
+ 	so that whichever core runs can take the lock.
+ */
+
+/** \cond HELPER A queue node of a spinlock. */
+typedef struct __spin_node {
+  struct __spin_node* next;   /* the next core in the queue */
+  int waiting;                /* cleared by the predecessor on unlock */
+  int busy;                   /* the node is in use by this core */
+} __attribute__((aligned(64))) __spin_node;
+/** \endcond */
+
+static __spin_node spin_nodes[MAX_CORES][SPINLOCK_NESTING];
+
+/* Non-zero if the spinlocks are queued, else they are test-and-set */
+static int spinlock_queued;
+
+/* The tail of a test-and-set spinlock that is locked */
+#define SPINLOCK_TAS_LOCKED ((void*) 1)
+
+void initialize_spinlocks()
+{
+  spinlock_queued = cpu_cores() <= cpu_physical_cores();
+}
+
+void Spinlock_Lock(Spinlock* lock)
+{
+  assert(! cpu_interrupts_enabled());
+
+  if(! spinlock_queued) {
+    while(__atomic_exchange_n(&lock->tail, SPINLOCK_TAS_LOCKED, __ATOMIC_ACQUIRE))
+      while(__atomic_load_n(&lock->tail, __ATOMIC_RELAXED))
+        cpu_relax();
+    return;
+  }
+
+  /* Running past the pool would take the nodes of the next core, even with NDEBUG */
+  __spin_node* node = spin_nodes[cpu_core_id];
+  __spin_node* end = node + SPINLOCK_NESTING;
+  while(node < end && node->busy) node++;
+  CHECK_CONDITION(node < end);
+
+  node->busy = 1;
+  node->next = NULL;
+  node->waiting = 1;
+
+  __spin_node* pred = __atomic_exchange_n((__spin_node**) &lock->tail, node, __ATOMIC_ACQ_REL);
+  if(pred != NULL) {
+    __atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+    while(__atomic_load_n(&node->waiting, __ATOMIC_ACQUIRE))
+      cpu_relax();
+  }
+  lock->holder = node;
+}
+
+void Spinlock_Unlock(Spinlock* lock)
+{
+  if(! spinlock_queued) {
+    __atomic_store_n(&lock->tail, NULL, __ATOMIC_RELEASE);
+    return;
+  }
+
+  __spin_node* node = lock->holder;
+  __spin_node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+  if(next == NULL) {
+    /* No known successor: try to leave the lock free */
+    __spin_node* expected = node;
+    if(__atomic_compare_exchange_n((__spin_node**) &lock->tail, &expected, NULL, 0,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      goto done;
+
+    /* A core is appending itself, wait for it to link */
+    while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+      cpu_relax();
+  }
+  __atomic_store_n(&next->waiting, 0, __ATOMIC_RELEASE);
+
+done:
+  node->busy = 0;
+}
+
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	blocking mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	In the preemptive domain, a thread that finds the mutex locked spins 
+ 	only while the holder is running on another core, as it will probably 
+ 	unlock it soon. Else, it parks on the wait queue of the mutex and 
+ 	sleeps. Unlocking a mutex with parked threads wakes up the first of 
+ 	them, which competes for the mutex again. Running threads may take it 
+ 	first, so that the mutex does not have to pass through a context 
+ 	switch on every unlock. A woken thread that loses this race parks again 
+ 	at the head of the queue, and the next unlock hands the mutex directly 
+ 	to it: it stays locked, so that no other thread can take it before 
+ 	the woken thread runs.
+
+ 	The wait queues of all mutexes are protected by a small table of 
+ 	spinlocks (locked only with preemption off), hashed by mutex address.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
-{
+/* The values of Mutex.lock. A waiter that blocks marks the mutex contended. */
+#define MUTEX_LOCKED 1
+#define MUTEX_CONTENDED 2
+
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-#if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
-#endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
+/* How often (in spins) a spinning waiter checks that the holder still runs */
+#define MUTEX_OWNER_CHECK 64
+
+/* The spinlocks of the mutex wait queues */
+#define MUTEX_PARK_BUCKETS 64
+static Spinlock park_lock[MUTEX_PARK_BUCKETS];
+
+static inline Spinlock* park_bucket(Mutex* lock)
+{
+  return & park_lock[((uintptr_t)lock / sizeof(Mutex)) % MUTEX_PARK_BUCKETS];
+}
+
+/** \cond HELPER A thread parked on a mutex. */
+typedef struct __mutex_waiter {
+  rlnode node;            /* become part of the wait queue ring */
+  TCB* thread;            /* the parked thread */
+  int handoff;            /* the thread has lost the mutex after a wakeup */
+  sig_atomic_t woken;     /* set when the thread is removed from the queue */
+  sig_atomic_t granted;   /* set when the mutex is handed to the thread */
+} __mutex_waiter;
+/** \endcond */
+
+static inline int mutex_trylock(Mutex* lock, char state)
+{
+  char unlocked = 0;
+  return __atomic_compare_exchange_n(&lock->lock, &unlocked, state, 0,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* Remove a waiter from the wait queue of a mutex, with its bucket locked */
+static inline void mutex_unqueue(Mutex* lock, __mutex_waiter* w)
+{
+  if(lock->waiters == w) {
+    __mutex_waiter* nextw = w->node.next->obj;
+    lock->waiters = (nextw == w) ? NULL : nextw;
+  }
+  rlist_remove(& w->node);
+}
+
+/* Lock in the preemptive domain: spin while the holder runs, then park */
+static void mutex_lock_blocking(Mutex* lock)
+{
+  TCB* self = cur_thread();
+
+  /* 
+    Once woken, we must leave the mutex contended when we take it, since
+    other threads may still be parked.
+   */
+  char state = MUTEX_LOCKED;
+  int handoff = 0;
+
+  for(;;) {
+    /* Adaptive spinning */
+    for(int spin = MUTEX_SPINS; spin > 0; spin--) {
+      if(__atomic_load_n(&lock->lock, __ATOMIC_RELAXED) == 0 && mutex_trylock(lock, state))
+        goto acquired;
+      cpu_relax();
+      if(spin % MUTEX_OWNER_CHECK == 0) {
+        TCB* owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+        if(owner != NULL && ! sched_thread_running(owner)) break;
       }
     }
+
+    /* Lend our priority to the holder */
+    sched_inherit_priority(&lock->owner);
+
+    /* Park, unless the mutex was unlocked meanwhile */
+    __mutex_waiter waiter = { .thread = self, .handoff = handoff, .woken = 0, .granted = 0 };
+    rlnode_init(& waiter.node, &waiter);
+
+    int preempt = preempt_off;
+    Spinlock* bucket = park_bucket(lock);
+    Spinlock_Lock(bucket);
+    if(__atomic_exchange_n(&lock->lock, MUTEX_CONTENDED, __ATOMIC_ACQUIRE) == 0) {
+      Spinlock_Unlock(bucket);
+      if(preempt) preempt_on;
+      goto acquired;
+    }
+    if(lock->waiters) {
+      __mutex_waiter* wq = lock->waiters;
+      rlist_push_back(& wq->node, & waiter.node);
+      /* A thread that lost the mutex goes first */
+      if(handoff) lock->waiters = &waiter;
+    } else {
+      lock->waiters = &waiter;
+    }
+    sleep_releasing(STOPPED, bucket, NULL, SCHED_MUTEX, NO_TIMEOUT);
+
+    /* We were woken by an unlock, or else for some other reason */
+    if(! __atomic_load_n(&waiter.woken, __ATOMIC_ACQUIRE)) {
+      Spinlock_Lock(bucket);
+      if(! waiter.woken)
+        mutex_unqueue(lock, &waiter);
+      Spinlock_Unlock(bucket);
+    }
+    if(preempt) preempt_on;
+
+    /* The unlocker has already made us the owner */
+    if(waiter.granted) {
+      self->locks_held++;
+      return;
+    }
+
+    state = MUTEX_CONTENDED;
+    handoff |= waiter.woken;
+  }
+
+acquired:
+  __atomic_store_n(&lock->owner, self, __ATOMIC_RELAXED);
+  self->locks_held++;
+}
+
+/* Record the new holder of a mutex locked without blocking */
+static inline void mutex_acquired(Mutex* lock)
+{
+  TCB* self = cur_thread_fast();
+  __atomic_store_n(&lock->owner, self, __ATOMIC_RELAXED);
+  if(self != NULL) self->locks_held++;
+}
+
+
+void Mutex_Lock(Mutex* lock)
+{
+  if(mutex_trylock(lock, MUTEX_LOCKED)) {
+    mutex_acquired(lock);
+    return;
+  }
+
+  if(cpu_interrupts_enabled()) {
+    mutex_lock_blocking(lock);
+    return;
   }
-#undef MUTEX_SPINS
+
+  /* Non-preemptive domain: spin */
+  do {
+    while(__atomic_load_n(&lock->lock, __ATOMIC_RELAXED))
+      cpu_relax();
+  } while(! mutex_trylock(lock, MUTEX_LOCKED));
+  mutex_acquired(lock);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  TCB* owner = lock->owner;
+  __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELAXED);
+
+  char held = MUTEX_LOCKED;
+  if(! __atomic_compare_exchange_n(&lock->lock, &held, 0, 0, 
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+
+    /* Contended: wake up the first parked waiter, if any */
+    int preempt = preempt_off;
+    Spinlock* bucket = park_bucket(lock);
+    Spinlock_Lock(bucket);
+    __mutex_waiter* w = lock->waiters;
+    if(w != NULL) {
+      mutex_unqueue(lock, w);
+      TCB* next = w->thread;
+      if(w->handoff) {
+        /* It has lost the mutex once already, hand it over */
+        __atomic_store_n(&lock->owner, next, __ATOMIC_RELAXED);
+        __atomic_store_n(&lock->lock, lock->waiters ? MUTEX_CONTENDED : MUTEX_LOCKED, __ATOMIC_RELEASE);
+        w->granted = 1;
+      } else {
+        __atomic_store_n(&lock->lock, 0, __ATOMIC_RELEASE);
+      }
+      __atomic_store_n(&w->woken, 1, __ATOMIC_RELEASE);
+      /* w is on the stack of the waiter; it may be gone after the wakeup */
+      wakeup(next);
+    }
+    else 
+      __atomic_store_n(&lock->lock, 0, __ATOMIC_RELEASE);
+    Spinlock_Unlock(bucket);
+    if(preempt) preempt_on;
+  }
+
+  /* 
+    A waiter of any mutex that we hold may have lent us its priority, 
+    so we keep it until we release the last one.
+   */
+  if(owner != NULL && --owner->locks_held == 0 && owner->pi_saved >= 0) {
+    /* A thread with a higher priority may be waiting, let it run */
+    sched_restore_priority(owner);
+    if(cpu_interrupts_enabled())
+      yield(SCHED_MUTEX);
+  }
 }
 
 
@@ -124,7 +407,8 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
 	rlnode_init(& waiter.node, &waiter);
 
-	Mutex_Lock(&(cv->waitset_lock));
+	int preempt = preempt_off;
+	Spinlock_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
 		__cv_waiter* wset = cv->waitset;
@@ -133,19 +417,19 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 		cv->waitset = &waiter;
 	}
 
-	/* Now atomically release mutex and sleep */
-	Mutex_Unlock(mutex);
-	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
+	/* Now atomically release the waitset lock and the mutex, and sleep */
+	sleep_releasing(STOPPED, &(cv->waitset_lock), mutex, cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	Spinlock_Lock(&(cv->waitset_lock));
 	if(! waiter.removed) {
 		assert(! waiter.signalled);
 
 		/* We must remove ourselves from the ring! */
 		remove_from_ring(cv, &waiter);
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
+	Spinlock_Unlock(&(cv->waitset_lock));
+	if(preempt) preempt_on;
 
 	Mutex_Lock(mutex);
 	return waiter.signalled;
@@ -188,17 +472,21 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
+  int preempt = preempt_off;
+  Spinlock_Lock(&(cv->waitset_lock));
   cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  Spinlock_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
 }
 
 
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
+  int preempt = preempt_off;
+  Spinlock_Lock(&(cv->waitset_lock));
   while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  Spinlock_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
 }
 
 
@@ -211,61 +499,33 @@ void Cond_Broadcast(CondVar* cv)
  *
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+/*
+	There is no global kernel lock. Each kernel subsystem protects its
+	own data with its own Mutex (e.g., the process table is protected by
+	@c proc_lock and each pipe by its own lock), and a system call takes
+	only the locks of the objects it touches. A kernel thread that must
+	block waits on a condition variable, releasing the lock that protects
+	the condition.
+
+	Locks are taken in this order:
+	- proc_lock (the process table, the process tree and the threads)
+	- fidt_lock, the lock of a process' file id table
+	- the port map lock, then the lock of a listening socket
+	- the lock of a pipe or a device
+	- file_lock (the free FCBs)
+
+	Exec copies the file id table with FCB_inherit(), and Exit closes
+	it with FCB_close_all(), both with proc_lock held. FCB_close_all()
+	releases fidt_lock before calling the Close operations of the 
+	streams, so the locks of pipes, sockets and devices nest under 
+	proc_lock, but never under fidt_lock. Within fidt_lock, only 
+	file_lock may be taken.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
-{
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
-}
-
-void kernel_unlock()
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
-}
-
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +538,7 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_sleep(Mutex* mx, Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	sleep_releasing(newstate, NULL, mx, cause, NO_TIMEOUT);
 }
-
-
-
-
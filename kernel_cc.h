@@ -33,36 +33,34 @@
 
 
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Kernel locking.
+ *
+ * There is no big kernel lock: each subsystem and kernel object is 
+ * protected by its own Mutex, and these wrappers wait on kernel 
+ * conditions while releasing the lock that protects them.
  */
 
 /**
-	@brief Lock the kernel.
- */
-void kernel_lock();
+	@brief Wait on a condition variable, releasing a kernel lock.
 
-/**
-	@brief Unlock the kernel.
- */
-void kernel_unlock();
+	The calling thread must hold @c mx, which is released while the
+	thread sleeps and is re-acquired before the call returns.
 
-/**
-	@brief Wait on a condition variable using the kernel lock.
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
 
-	This call must be made 
+	This call should be made while holding the lock that protects the
+	condition, else the signal may be lost.
   */
 void kernel_signal(CondVar* cv);
 
@@ -73,13 +71,51 @@ void kernel_broadcast(CondVar* cv);
 
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put thread to sleep, releasing a kernel lock.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	The calling thread must hold @c mx. The lock is released atomically
+	with the thread going to sleep, and it is not re-acquired.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_sleep(Mutex* mx, Thread_state state, enum SCHED_CAUSE cause);
+
+
+
+/**
+	@brief Lock a queued spinlock.
+
+	This must be called in the non-preemptive domain, which the caller must
+	not leave before unlocking. The lock is queued (MCS): each waiting core
+	spins on a node of its own, and gets the lock in the order of arrival.
+	A core may hold up to @c SPINLOCK_NESTING spinlocks at a time.
+
+	If the VM has more cores than the host has processors, the lock is 
+	test-and-set instead (see @c initialize_spinlocks()).
 
+	@see Spinlock
+	@see Spinlock_Unlock
+ */
+void Spinlock_Lock(Spinlock* lock);
+
+/**
+	@brief Unlock a queued spinlock, passing it to the next waiting core.
+
+	This must be called on the core that locked @c lock.
+ */
+void Spinlock_Unlock(Spinlock* lock);
+
+/** @brief The maximum number of spinlocks that a core may hold at a time */
+#define SPINLOCK_NESTING 8
+
+/**
+	@brief Choose the kind of the spinlocks for this boot.
+
+	The spinlocks are queued only if every core of the VM has a host 
+	processor of its own. Otherwise, a queued lock could pass to a core
+	that the host is not running, and stall all the cores behind it.
+	This is called during kernel initialization, before any spinlock
+	is used.
+ */
+void initialize_spinlocks();
 
 
 /** @brief Set the preemption status for the current core.
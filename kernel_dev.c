@@ -68,8 +68,9 @@ void serial_tx_handler();
 
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  Mutex spinlock;     /* Protects reads and rx_ready */
   CondVar rx_ready;
+  Mutex tx_lock;      /* Serializes writes */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -90,7 +91,10 @@ void serial_rx_handler()
    */
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
+    /* A reader holds the lock (non-preemptively) from its read to its wait */
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
@@ -103,22 +107,19 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
-    }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
-    }
-    else
+  /* Read whatever the device has, waiting only if it has nothing */
+  while(size > 0) {
+    count = bios_read_serial_buf(dcb->devno, buf, size);
+    if(count > 0)
       break;
+    kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -143,12 +144,13 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  Mutex_Lock(&dcb->tx_lock);
   unsigned int count = 0;
   while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
+    unsigned int n = bios_write_serial_buf(dcb->devno, buf+count, size-count);
 
-    if(success) {
-      count++;
+    if(n > 0) {
+      count += n;
     } 
     else if(count==0)
     {
@@ -157,6 +159,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
     else
       break;
   }
+  Mutex_Unlock(&dcb->tx_lock);
 
   return count;  
 }
@@ -195,6 +198,14 @@ DCB devtable[DEV_MAX];
 
 
 
+/*
+  Keyboard interrupts are coalesced: a fast input stream raises one
+  interrupt per SERIAL_RX_COALESCE_BYTES bytes, and a single keystroke
+  is delayed by at most SERIAL_RX_COALESCE_DELAY usec.
+ */
+#define SERIAL_RX_COALESCE_BYTES 256
+#define SERIAL_RX_COALESCE_DELAY 500
+
 void initialize_devices()
 {
 
@@ -211,6 +222,8 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_lock = MUTEX_INIT;
+    bios_serial_coalesce(i, SERIAL_RX_READY, SERIAL_RX_COALESCE_BYTES, SERIAL_RX_COALESCE_DELAY);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
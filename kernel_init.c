@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -26,7 +27,9 @@ static struct {
   Task init_task;
   int argl;
   void* args;
-} boot_rec;
+  sched_policy policy;
+  int virtual_time;
+} boot_rec = { .policy = SCHED_POLICY_MLFQ, .virtual_time = 0 };
 
 
 /* Per-core boot function for tinyos */
@@ -35,10 +38,11 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Initialize the kenrel data structures */
+    initialize_spinlocks();
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_scheduler(boot_rec.policy);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -53,8 +57,11 @@ void boot_tinyos_kernel()
 
   run_scheduler();
 
+  cpu_core_barrier_sync();
+
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+    finalize_scheduler();
   }
 }
 
@@ -65,7 +72,29 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.argl = argl;
   boot_rec.args = args;
 
-  vm_boot(boot_tinyos_kernel, ncores, nterm);
+  vm_config vmc;
+  vm_configure(&vmc, boot_tinyos_kernel, ncores, nterm);
+  vmc.virtual_time = boot_rec.virtual_time;
+  vm_run(&vmc);
+}
+
+
+int boot_policy(sched_policy policy)
+{
+  if(policy < 0 || policy >= SCHED_POLICIES)
+    return -1;
+
+  sched_policy prev = boot_rec.policy;
+  boot_rec.policy = policy;
+  return prev;
+}
+
+
+int boot_virtual_time(int on)
+{
+  int prev = boot_rec.virtual_time;
+  boot_rec.virtual_time = (on != 0);
+  return prev;
 }
 
 
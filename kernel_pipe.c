@@ -33,6 +33,7 @@ int sys_Pipe(pipe_t* pipe)
 		return -1;
 	} else {
 		pipe_cb *pipecb = (pipe_cb* )xmalloc(sizeof(pipe_cb));
+		pipecb->lock = MUTEX_INIT;
 
 		// The two file descriptors. fd[0] for read and fd[1] for write (READ -> r, WRITE->w)
 		// General, happens at start and has nothing to do with reserving FCB and other pipecb variables.
@@ -49,18 +50,18 @@ int sys_Pipe(pipe_t* pipe)
 
 		// Initialiaze reader stuff
 		pipecb->reader = 0;
-		fcb[0]->streamobj = pipecb;
-		fcb[0]->streamfunc = &reader_file_ops;
 
 		// Initialize writer stuff
 		pipecb->writer = 0;
-		fcb[1]->streamobj = pipecb;
-		fcb[1]->streamfunc = &writer_file_ops;
 
 		// Has_space blocks writer if there is no space to write, has_data blocks the reader until data to read are available
 		pipecb->has_data = COND_INIT;
 		pipecb->has_space = COND_INIT;
 
+		// Only now may other threads use the two streams
+		FCB_publish(fcb[0], pipecb, &reader_file_ops);
+		FCB_publish(fcb[1], pipecb, &writer_file_ops);
+
 		return 0;
 
 	}
@@ -70,14 +71,17 @@ int pipe_write(void* pipecb_t, const char* buf, unsigned int n){
 	pipe_cb *pipecb = (pipe_cb* ) pipecb_t;
 	int counter = 0;
 
+	Mutex_Lock(&pipecb->lock);
+
 	// Check if Writer or Reader is closed
 	if(pipecb->writer == NULL || pipecb->reader == NULL){
+		Mutex_Unlock(&pipecb->lock);
 		return -1; 	
 	}
 
 	// If writer loops buffer and reaches reader, enable kernel_wait on him with has_space
 	while(((pipecb->w_position+1)%PIPE_BUFFER_SIZE) == pipecb->r_position && pipecb->reader != NULL){
-		kernel_wait((&pipecb->has_space), SCHED_PIPE);
+		kernel_wait(&pipecb->lock, (&pipecb->has_space), SCHED_PIPE);
 	}
 
 	// Do write normally as long as writer is behind reader and there is space to write and there is space in the buffer
@@ -89,6 +93,7 @@ int pipe_write(void* pipecb_t, const char* buf, unsigned int n){
 	}
 
 	kernel_broadcast(&(pipecb->has_data));
+	Mutex_Unlock(&pipecb->lock);
 	return counter;
 }
 
@@ -97,14 +102,13 @@ int pipe_writer_close(void* _pipecb){
 	pipe_cb *pipecb = (pipe_cb*) _pipecb;
 
 	if(pipecb != NULL){
+		Mutex_Lock(&pipecb->lock);
 		pipecb->writer = NULL; // closing the writer...
 
 		if(pipecb->reader != NULL){
 			kernel_broadcast(&(pipecb->has_data));
-		} else {
-			pipecb = NULL;
-			free(pipecb);
 		}
+		Mutex_Unlock(&pipecb->lock);
 	}
 	return 0;
 }
@@ -113,28 +117,33 @@ int pipe_writer_close(void* _pipecb){
 int pipe_read(void* pipecb_t, char* buf, unsigned int n){
 	pipe_cb  *pipecb = (pipe_cb*) pipecb_t;
 	int counter = 0; 
+
+	Mutex_Lock(&pipecb->lock);
 	
 	// Check if Reader is closed. 
 	if(pipecb->reader == NULL){
+		Mutex_Unlock(&pipecb->lock);
 		return -1; // no need to do anything in this function
 	}
 
 	// Check if Reader has reached Writer 
 	// If yes and there is nothing to read, activate kernel_wait with has_Data
 	while(pipecb->r_position == pipecb->w_position && pipecb->writer != NULL) {
-		kernel_wait(&(pipecb->has_data), SCHED_PIPE);
+		kernel_wait(&pipecb->lock, &(pipecb->has_data), SCHED_PIPE);
 	}
 
 	// If there are no new writes and the reader is behind writer, keep on reading everything that remains
 	if(pipecb->writer == NULL){
 		while(pipecb->r_position < pipecb->w_position){	
 			if (counter == n){
-				return -1;
+				counter = -1;
+				break;
 			}
 			buf[counter] = pipecb->BUFFER[pipecb->r_position];
 			pipecb->r_position = (pipecb->r_position + 1) % PIPE_BUFFER_SIZE;
 			counter ++;
 		}
+		Mutex_Unlock(&pipecb->lock);
 		return counter;
 	}
 
@@ -146,6 +155,7 @@ int pipe_read(void* pipecb_t, char* buf, unsigned int n){
 	}
 
 	kernel_broadcast(&pipecb->has_space);
+	Mutex_Unlock(&pipecb->lock);
 	return counter;
 
 }
@@ -154,14 +164,13 @@ int pipe_read(void* pipecb_t, char* buf, unsigned int n){
 int pipe_reader_close(void* _pipecb){
 	pipe_cb *pipecb = (pipe_cb*) _pipecb;
 	if(pipecb != NULL){
+		Mutex_Lock(&pipecb->lock);
 		pipecb->reader = NULL; // closing the reader...
 
 		if(pipecb->writer != NULL){
 			kernel_broadcast(&(pipecb->has_space));
-		} else {
-			pipecb = NULL;
-			free(pipecb);
 		}
+		Mutex_Unlock(&pipecb->lock);
 	}
 
 	return 0;
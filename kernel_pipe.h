@@ -5,6 +5,7 @@
 
 typedef struct pipe_control_block
 {
+	Mutex lock; // Protects the pipe; readers and writers wait releasing it
 	FCB *reader, *writer;
 	CondVar has_space; // For blocking writer if no space is available
 	CondVar has_data; // For blocking reader until data are available
@@ -21,6 +21,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* The lock of the process table */
+Mutex proc_lock = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -45,6 +48,7 @@ static inline void initialize_PCB(PCB* pcb)
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
+  pcb->fidt_lock = MUTEX_INIT;
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
@@ -81,7 +85,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -98,7 +102,7 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -138,6 +142,8 @@ void start_main_thread()
 Pid_t sys_Exec(Task call, int argl, void* args)
 {
   PCB *curproc, *newproc;
+
+  Mutex_Lock(&proc_lock);
   
   /* The new process PCB */
   newproc = acquire_PCB();
@@ -159,17 +165,16 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    FCB_inherit(newproc, curproc);
   }
 
 
   /* Set the main thread's function */
   newproc->main_task = call;
 
+  /* Inherit the thread stack size */
+  newproc->stack_size = (newproc->parent==NULL) ? THREAD_STACK_SIZE : curproc->stack_size;
+
   /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
   if(args!=NULL) {
@@ -189,7 +194,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   if(call != NULL) {
 
     // Create a thread...
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, newproc->stack_size);
     rlnode_init(&newproc->ptcb_list, newproc);     // For original PCB list 
    
     // Create a PTCB
@@ -204,6 +209,8 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     new_ptcb->detached = 0;
     new_ptcb->exit_cv = COND_INIT;
     new_ptcb->refcount = 1;
+    new_ptcb->stack_size = newproc->stack_size;
+    new_ptcb->stack_used = 0;
 
     // Initializing list aka rlnode stuff
     rlnode_init(&(new_ptcb->ptcb_list_node), new_ptcb);      // For new PTCB list 
@@ -220,6 +227,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
 
 finish:
+  Mutex_Unlock(&proc_lock);
   return get_pid(newproc);
 }
 
@@ -233,7 +241,11 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* The parent changes when the process is adopted by init */
+  Mutex_Lock(&proc_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(&proc_lock);
+  return ppid;
 }
 
 
@@ -268,7 +280,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -292,7 +304,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -309,15 +321,19 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Mutex_Lock(&proc_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  Mutex_Unlock(&proc_lock);
+  return cpid;
 }
 
 
@@ -326,6 +342,8 @@ void sys_Exit(int exitval)
 
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
+  Mutex_Lock(&proc_lock);
+
   /* First, store the exit status */
   curproc->exitval = exitval;
   /* 
@@ -334,7 +352,7 @@ void sys_Exit(int exitval)
    */
   if(get_pid(curproc)==1) {
 
-    while(sys_WaitChild(NOPROC,NULL)!=NOPROC);
+    while(wait_for_any_child(NULL)!=NOPROC);
 
   } else {
 
@@ -374,12 +392,7 @@ void sys_Exit(int exitval)
   }
 
   /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
+  FCB_close_all(curproc);
 
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
@@ -388,7 +401,7 @@ void sys_Exit(int exitval)
   curproc->pstate = ZOMBIE;
 
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  kernel_sleep(&proc_lock, EXITED, SCHED_USER);
 
   //sys_ThreadExit(exitval);
 
@@ -400,6 +413,7 @@ int procinfo_read(void* procinfo_cb, char* buf, unsigned int size){
   procinfo* procinfocb = (procinfo*) procinfo_cb;
   procinf_cb* picb = (procinf_cb*)xmalloc(sizeof(procinf_cb));
 
+  Mutex_Lock(&proc_lock);
   for(Pid_t i=0; i<MAX_PROC; i++){
     if(PT[i].pstate != FREE){
       // Get pid and ppid 
@@ -425,6 +439,7 @@ int procinfo_read(void* procinfo_cb, char* buf, unsigned int size){
       picb->pcb_cursor ++;
     }
   }
+  Mutex_Unlock(&proc_lock);
   return size;
 }
 
@@ -451,8 +466,55 @@ Fid_t sys_OpenInfo()
     return NOFILE;
 
   picb->pcb_cursor = 1;                                           // Initialize everything from proc_info_control_block
-  fcb[0]->streamobj = picb;                                       // created on kernel_sysinfo.h
-  fcb[0]->streamfunc = &proc_info;
+  FCB_publish(fcb[0], picb, &proc_info);                          // created on kernel_sysinfo.h
 
   return fid[0];
 }
+
+
+/* Scheduler info streams. The stream object is the next core to report. */
+
+static int schedinfo_read(void* cursor, char* buf, unsigned int size)
+{
+  uint* core = cursor;
+  if(*core >= cpu_cores())
+    return 0;
+  if(size < sizeof(schedinfo))
+    return -1;
+
+  schedinfo info;
+  sched_core_info((*core)++, &info);
+  memcpy(buf, &info, sizeof(info));
+  return sizeof(info);
+}
+
+static int schedinfo_write(void* cursor, const char* buf, unsigned int size)
+{
+  return -1;
+}
+
+static int schedinfo_close(void* cursor)
+{
+  free(cursor);
+  return 0;
+}
+
+static file_ops sched_info = {
+  .Open = NULL,
+  .Read = schedinfo_read,
+  .Write = schedinfo_write,
+  .Close = schedinfo_close
+};
+
+Fid_t sys_OpenSchedInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  uint* cursor = xmalloc(sizeof(uint));
+  *cursor = 0;
+  FCB_publish(fcb, cursor, &sched_info);
+  return fid;
+}
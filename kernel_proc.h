@@ -49,6 +49,8 @@ typedef struct process_control_block {
   int argl;               /**< @brief The main thread's argument length */
   void* args;             /**< @brief The main thread's argument string */
 
+  size_t stack_size;      /**< @brief The stack size of new threads, inherited by children */
+
   rlnode children_list;   /**< @brief List of children */
   rlnode exited_list;     /**< @brief List of exited children */
 
@@ -62,9 +64,18 @@ typedef struct process_control_block {
                              @c WaitChild() */
 
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  Mutex fidt_lock;        /**< @brief Protects @c FIDT, shared by the threads of the process */
 
 } PCB;
 
+/**
+  @brief The lock of the process table.
+
+  This lock protects the process table, the parent/child links and the
+  exit state of processes, as well as the threads (PTCBs) of each process.
+*/
+extern Mutex proc_lock;
+
 /**
   @brief Initialize the process table.
 
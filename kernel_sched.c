@@ -21,9 +21,21 @@
 /* Core control blocks */
 CCB cctx[MAX_CORES];
 
-#define PRIORITY_QUEUES 80
+/* Number of yields of a core between two advances of the boost epoch */
 #define YIELDS 100
 
+/*
+	The priority boost epoch. Every YIELDS yields, a core advances it by one.
+	Each core applies the boosts it has missed to its own queues lazily, 
+	the next time it touches them (see sched_queue_catchup()).
+ */
+static volatile unsigned long boost_epoch = 0;
+
+_Static_assert(PRIORITY_QUEUES <= THREADINFO_LEVELS, "ThreadInfo cannot report all priority levels");
+
+/* Spinlock for priority inheritance, see sched_inherit_priority() */
+static Spinlock pi_lock = SPINLOCK_INIT;
+
 /* 
 	The current core's CCB. This must only be used in a 
 	non-preemtpive context.
@@ -51,33 +63,51 @@ TCB* cur_thread()
   return cur;
 }
 
+/*
+  A thread preempted between reading its core id and the core's current
+  thread may resume on another core. Then, it reads the core id again.
+  Once the current thread is read, it is correct, since a thread that is
+  switched back in is again the current thread of its core.
+ */
+TCB* cur_thread_fast()
+{
+  uint core;
+  TCB* cur;
+  do {
+    core = *(volatile uint*)&cpu_core_id;
+    cur = __atomic_load_n(&cctx[core].current_thread, __ATOMIC_RELAXED);
+  } while(core != *(volatile uint*)&cpu_core_id);
+  return cur;
+}
+
 
 
 /*
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 architecture, the stack grows downward. The TCB is allocated 
+  at the bottom of the memory block of the thread, and the stack above it.
 
   +-------------+
-  |   TCB       |
+  | first frame |
   +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |  (only with MMAPPED_THREAD_MEM)
+  +-------------+
+  |   TCB       |
   +-------------+
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  Advantages: unified memory area for stack and TCB.
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  Disadvantages: The stack cannot grow, and a stack overrun runs into the 
+  thread's own TCB. With MMAPPED_THREAD_MEM, a PROT_NONE guard page between 
+  the two turns an overrun into a segmentation fault.
  */
 
 /*
@@ -94,14 +124,25 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+#ifdef MMAPPED_THREAD_MEM
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+#else
+#define THREAD_GUARD_SIZE 0
+#endif
+
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_TCB_SIZE + THREAD_GUARD_SIZE + (stack_size))
 
+/* The lowest address of the stack of a thread */
+#define THREAD_STACK(tcb) (((void*)(tcb)) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE)
+
+/* Define this (e.g., with 'make MMAPPED_THREAD_MEM=1') for guard-paged stacks */
 //#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
+  Use mmap to allocate a thread, and make the page above the TCB a
+  "sentinel page", with access PROT_NONE, so that a stack overflow
   is detected as seg.fault.
  */
 void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
@@ -112,6 +153,7 @@ void* allocate_thread(size_t size)
 		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	CHECK(mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE));
 
 	return ptr;
 }
@@ -131,6 +173,147 @@ void* allocate_thread(size_t size)
 #endif
 
 
+/*
+  The thread pool.
+  --------------------
+
+  Released threads are not freed right away, but kept for reuse, so that 
+  creating a thread usually costs neither an allocation nor (with 
+  MMAPPED_THREAD_MEM) a system call. Every core keeps a small cache of 
+  free thread blocks in its CCB, one list per stack size; this is only 
+  accessed by its own core, in the non-preemptive domain, so it needs no 
+  lock. A core's cache that overflows spills into a global pool, from 
+  which cores with an empty cache refill. Blocks beyond the capacity of 
+  the global pool are freed. Capacities are in bytes, so that a few huge 
+  stacks do not pin a lot of memory.
+
+  A free block is linked through the sched_node of its (dead) TCB, which
+  also keeps its stack size and the high-water mark of its last thread.
+ */
+#define THREAD_CACHE_BYTES (2ul << 20)
+#define THREAD_POOL_BYTES (32ul << 20)
+
+static rlnode thread_pool[THREAD_STACK_CLASSES];
+static size_t thread_pool_bytes = 0;
+static Mutex thread_pool_lock = MUTEX_INIT;
+
+/* The index of a (legal) stack size, in 0..THREAD_STACK_CLASSES-1 */
+static inline uint stack_class(size_t stack_size)
+{
+	return __builtin_ctzl(stack_size / THREAD_STACK_MIN);
+}
+
+size_t thread_stack_size(size_t size)
+{
+	size_t ssize = THREAD_STACK_MIN;
+	while (ssize < size && ssize < THREAD_STACK_MAX)
+		ssize <<= 1;
+	return (ssize < size) ? 0 : ssize;
+}
+
+size_t thread_stack_used(TCB* tcb)
+{
+#ifdef THREAD_STACK_CANARY
+	uint64_t* p = THREAD_STACK(tcb);
+	uint64_t* top = THREAD_STACK(tcb) + tcb->stack_size;
+	while (p < top && *p == THREAD_STACK_PATTERN)
+		p++;
+	return (void*)top - (void*)p;
+#else
+	return 0;
+#endif
+}
+
+/* Get a thread block from the pool, or allocate a new one */
+static TCB* acquire_thread(size_t stack_size)
+{
+	uint class = stack_class(stack_size);
+	TCB* tcb = NULL;
+
+	int preempt = preempt_off;
+	CCB* core = &cctx[cpu_core_id];
+	if (!is_rlist_empty(&core->thread_cache[class])) {
+		tcb = rlist_pop_front(&core->thread_cache[class])->tcb;
+		core->thread_cache_bytes -= THREAD_SIZE(stack_size);
+	} else if (!is_rlist_empty(&thread_pool[class])) {
+		Mutex_Lock(&thread_pool_lock);
+		if (!is_rlist_empty(&thread_pool[class])) {
+			tcb = rlist_pop_front(&thread_pool[class])->tcb;
+			thread_pool_bytes -= THREAD_SIZE(stack_size);
+		}
+		Mutex_Unlock(&thread_pool_lock);
+	}
+	if (preempt)
+		preempt_on;
+
+	if (tcb == NULL) {
+		tcb = allocate_thread(THREAD_SIZE(stack_size));
+		tcb->stack_size = stack_size;
+		tcb->stack_used = stack_size; /* all of it needs the canary */
+	}
+	assert(tcb->stack_size == stack_size);
+
+#ifdef THREAD_STACK_CANARY
+	/* Only the part of the stack used by the previous thread lost its canary */
+	uint64_t* top = THREAD_STACK(tcb) + stack_size;
+	for (uint64_t* p = top - tcb->stack_used/sizeof(uint64_t); p < top; p++)
+		*p = THREAD_STACK_PATTERN;
+#endif
+
+	return tcb;
+}
+
+/* Return a thread block to the pool. Called in the non-preemptive domain. */
+static void recycle_thread(TCB* tcb)
+{
+	CCB* core = &cctx[cpu_core_id];
+	uint class = stack_class(tcb->stack_size);
+	size_t size = THREAD_SIZE(tcb->stack_size);
+
+	tcb->stack_used = thread_stack_used(tcb);
+	rlnode_init(&tcb->sched_node, tcb);
+
+	if (core->thread_cache_bytes + size <= THREAD_CACHE_BYTES) {
+		rlist_push_front(&core->thread_cache[class], &tcb->sched_node);
+		core->thread_cache_bytes += size;
+		return;
+	}
+
+	Mutex_Lock(&thread_pool_lock);
+	if (thread_pool_bytes + size <= THREAD_POOL_BYTES) {
+		rlist_push_front(&thread_pool[class], &tcb->sched_node);
+		thread_pool_bytes += size;
+		tcb = NULL;
+	}
+	Mutex_Unlock(&thread_pool_lock);
+
+	if (tcb != NULL)
+		free_thread(tcb, size);
+}
+
+/* Free all the thread blocks of a list */
+static void free_thread_list(rlnode* list)
+{
+	while (!is_rlist_empty(list)) {
+		TCB* tcb = rlist_pop_front(list)->tcb;
+		free_thread(tcb, THREAD_SIZE(tcb->stack_size));
+	}
+}
+
+/* Free all pooled thread blocks */
+static void drain_thread_pool()
+{
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		for (uint i = 0; i < THREAD_STACK_CLASSES; i++)
+			free_thread_list(&core->thread_cache[i]);
+		core->thread_cache_bytes = 0;
+	}
+	for (uint i = 0; i < THREAD_STACK_CLASSES; i++)
+		free_thread_list(&thread_pool[i]);
+	thread_pool_bytes = 0;
+}
+
 
 
 /*
@@ -152,10 +335,10 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
 	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	TCB* tcb = acquire_thread(stack_size);
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -168,19 +351,38 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->wakeup_time = NO_TIMEOUT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
+	tcb->priority = PRIORITY_QUEUES-1; /* New threads enter at the top level */
+	tcb->pi_saved = -1;
+	tcb->pi_level = -1;
+	tcb->locks_held = 0;
+	tcb->pi_lent = 0;
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
 
+	tcb->woken = 0;
+	tcb->stealable = 0;
+	memset(&tcb->stats, 0, sizeof(tcb->stats));
+	memset(&tcb->rt, 0, sizeof(tcb->rt));
+
+	/* Inherit the affinity of the creator; the boot thread may run anywhere */
+	TCB* creator = CURCORE.current_thread;
+	if (creator != NULL)
+		tcb->affinity = creator->affinity;
+	else
+		CORESET_FILL(&tcb->affinity);
+	tcb->last_core = cpu_core_id;
+	tcb->vruntime = cctx[cpu_core_id].min_vruntime; /* New threads start at the virtual time of their core */
+
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = THREAD_STACK(tcb);
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
@@ -192,15 +394,19 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called by gain(), in the non-preemptive domain.
  */
 void release_TCB(TCB* tcb)
 {
+	/* Wait for any sched_inherit_priority() that may still see tcb as an owner */
+	Spinlock_Lock(&pi_lock);
+	Spinlock_Unlock(&pi_lock);
+
 #ifndef NVALGRIND
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	recycle_thread(tcb);
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
@@ -218,317 +424,1448 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Every core keeps its own MLFQ of ready threads in its CCB, as an array
+  of doubly linked lists, one per priority level. The queues of a core are
+  protected by the core's @c sched_lock.
+
+  Threads are added to the queue of the core they last ran on, if they may
+  run there (see sched_place()), and a core always selects from its own 
+  queues. Only when a core would otherwise go idle does it look at the 
+  queues of other cores, stealing a thread from the busiest one.
+
+  The scheduler also keeps all the sleeping threads with a timeout in a
+  hierarchical timer wheel (see below). The wheel, together with the state 
+  transitions of sleeping threads (STOPPED -> READY and RUNNING -> STOPPED),
+  is protected by @c sched_spinlock. 
+
+  Priority inheritance (see sched_inherit_priority()) is serialized by
+  @c pi_lock.
+
+  Lock order: sched_spinlock before pi_lock, and pi_lock before any core's 
+  sched_lock. No code holds the sched_lock of two cores at the same time.
+  These are queued spinlocks (see Spinlock_Lock()), since all the cores
+  contend for them.
 */
 
-int numof_yield_calls = 0; // num of yield_calls
+Spinlock sched_spinlock = SPINLOCK_INIT; /* spinlock for sleep/wakeup and the timer wheel */
 
-rlnode SCHED[PRIORITY_QUEUES]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+/* 
+	A lower bound on the earliest wakeup time in the timer wheel, read 
+	without locking by yield() 
+*/
+static volatile TimerDuration next_timeout = NO_TIMEOUT;
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+/*
+	Idle cores. A core sets its bit here before it checks for work 
+	for the last time and halts (see idle_thread()). Whoever makes work 
+	available clears the bit of some idle core and interrupts it.
+ */
+static uint64_t idle_cores[BITMAP_WORDS(MAX_CORES)];
 
 /* Interrupt handle for inter-core interrupts */
 void ici_handler()
-{ /* noop for now... */
+{
+	/* Some core queued a real-time thread that should run here now */
+	CCB* core = &CURCORE;
+	if (core->rt_preempt) {
+		core->rt_preempt = 0;
+		yield(SCHED_PREEMPT);
+	}
+}
+
+/*
+	The timer wheel.
+
+	Time is measured in ticks of 2^WHEEL_TICK_SHIFT usec. A thread sleeping
+	until time w expires at tick ceil(w/tick), so that it is never woken 
+	early. The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots each; a slot 
+	of level l spans WHEEL_SLOTS^l ticks. 
+
+	A thread expiring at tick E is placed at the lowest level l such that E
+	and wheel_now agree on all bits above level l, in slot (E >> l*WHEEL_BITS)
+	modulo WHEEL_SLOTS. Therefore, the occupied slots of every level are 
+	always ahead of the wheel's position and there is no wrap-around. When
+	the wheel reaches the start of a slot of some level l>0, the threads
+	in it are cascaded down to lower levels. Threads too far in the future
+	for the top level wait in wheel_overflow.
+
+	Each level has a bitmap of occupied slots, so that the next tick with
+	work to do is found without scanning empty slots. Insertion and 
+	cancellation are O(1).
+ */
+#define WHEEL_TICK_SHIFT 8
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+#define WHEEL_OVERFLOW (WHEEL_LEVELS*WHEEL_SLOTS) /* timeout_slot of overflowed threads */
+
+static rlnode wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t wheel_bitmap[WHEEL_LEVELS];
+static rlnode wheel_overflow;
+static uint64_t wheel_now; /* The next tick to be processed */
+
+/* The first tick of the wheel period which contains tick t, at level l */
+static inline uint64_t wheel_period(uint64_t t, uint l) 
+{ 
+	return t & ~((UINT64_C(1) << (l+1)*WHEEL_BITS) - 1);
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Insert a thread into the wheel, according to its wakeup_time.
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+static void wheel_insert(TCB* tcb)
 {
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+	uint64_t expiry = (tcb->wakeup_time + (1 << WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+
+	/* Already expired threads go to the next slot to be processed */
+	if (expiry < wheel_now)
+		expiry = wheel_now;
+
+	for (uint l = 0; l < WHEEL_LEVELS; l++)
+		if (wheel_period(expiry, l) == wheel_period(wheel_now, l)) {
+			uint slot = (expiry >> l*WHEEL_BITS) & (WHEEL_SLOTS-1);
+			rlist_push_back(&wheel[l][slot], &tcb->sched_node);
+			wheel_bitmap[l] |= UINT64_C(1) << slot;
+			tcb->timeout_slot = l*WHEEL_SLOTS + slot;
+			return;
+		}
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
-	}
+	rlist_push_back(&wheel_overflow, &tcb->sched_node);
+	tcb->timeout_slot = WHEEL_OVERFLOW;
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Remove a thread from the wheel.
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static void wheel_remove(TCB* tcb)
 {
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
-
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	rlist_remove(&tcb->sched_node);
+	if (tcb->timeout_slot != WHEEL_OVERFLOW) {
+		uint l = tcb->timeout_slot / WHEEL_SLOTS;
+		uint slot = tcb->timeout_slot % WHEEL_SLOTS;
+		if (is_rlist_empty(&wheel[l][slot]))
+			wheel_bitmap[l] &= ~(UINT64_C(1) << slot);
+	}
 }
 
-/*
-	Adjust the state of a thread to make it READY.
+/* 
+  Return the first tick at which the wheel has work to do, or (uint64_t)-1 
+  if the wheel is empty. This is a lower bound on the earliest expiry.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
- */
-static void sched_make_ready(TCB* tcb)
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static uint64_t wheel_next_tick()
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
+	uint64_t next = (uint64_t)-1;
 
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
-	}
+	for (uint l = 0; l < WHEEL_LEVELS; l++)
+		if (wheel_bitmap[l]) {
+			uint slot = __builtin_ctzll(wheel_bitmap[l]);
+			uint64_t t = wheel_period(wheel_now, l) + ((uint64_t)slot << l*WHEEL_BITS);
+			if (t < next) next = t;
+		}
 
-	/* Mark as ready */
-	tcb->state = READY;
+	if (!is_rlist_empty(&wheel_overflow)) {
+		uint64_t t = wheel_period(wheel_now, WHEEL_LEVELS-1) + (UINT64_C(1) << WHEEL_LEVELS*WHEEL_BITS);
+		if (t < next) next = t;
+	}
+	return next;
+}
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+/* Move all threads of a list back into the wheel */
+static void wheel_reinsert(rlnode* list)
+{
+	while (!is_rlist_empty(list))
+		wheel_insert(rlist_pop_front(list)->tcb);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Advance the wheel up to the given time, moving all expired threads
+  into the list expired. Ticks with no work are skipped.
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
-static void sched_wakeup_expired_timeouts()
+static void wheel_advance(TimerDuration curtime, rlnode* expired)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	uint64_t now_tick = curtime >> WHEEL_TICK_SHIFT;
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
+	while (1) {
+		uint64_t t = wheel_next_tick();
+		if (t > now_tick) {
+			if (wheel_now <= now_tick)
+				wheel_now = now_tick + 1;
 			break;
-		sched_make_ready(tcb);
+		}
+		wheel_now = t;
+
+		/* Cascade the slots that start at this tick, from the top level down */
+		if (wheel_period(t, WHEEL_LEVELS-1) == t) {
+			rlnode list;
+			rlnode_init(&list, NULL);
+			rlist_append(&list, &wheel_overflow);
+			wheel_reinsert(&list);
+		}
+		for (int l = WHEEL_LEVELS-1; l > 0; l--) {
+			if (wheel_period(t, l-1) != t) continue;
+			uint slot = (t >> l*WHEEL_BITS) & (WHEEL_SLOTS-1);
+			if (wheel_bitmap[l] & (UINT64_C(1) << slot)) {
+				rlnode list;
+				rlnode_init(&list, NULL);
+				rlist_append(&list, &wheel[l][slot]);
+				wheel_bitmap[l] &= ~(UINT64_C(1) << slot);
+				wheel_reinsert(&list);
+			}
+		}
+
+		/* Expire the level-0 slot of this tick */
+		uint slot = t & (WHEEL_SLOTS-1);
+		if (wheel_bitmap[0] & (UINT64_C(1) << slot)) {
+			rlist_append(expired, &wheel[0][slot]);
+			wheel_bitmap[0] &= ~(UINT64_C(1) << slot);
+		}
+		wheel_now = t + 1;
 	}
 }
+
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Possibly add TCB to the scheduler timer wheel.
 
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
-
-
-// Weird to implement. Starting from top queue and goind down, trying to fing a thread, to use as a first. 
-// Integer helper is used to break the loop once the thread is found. 
-// If not found, decrease priority and start again.....
-static TCB* sched_queue_select(TCB* current)
+static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
-	
-	TCB* next_thread = NULL;
-	int i = PRIORITY_QUEUES;
-	int helper = 0;
-	while(i>0 && helper == 0){
-		rlnode* sel = rlist_pop_front(&SCHED[i]);
-		if(sel->tcb != NULL){
-			next_thread = sel->tcb; /* When the list is empty, this is NULL */
-			helper = 1;	// to escape loop 
-		}
-		else i--;
-	}
-
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+	if (timeout != NO_TIMEOUT) {
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = curtime + timeout;
 
-	next_thread->its = QUANTUM;
+		wheel_insert(tcb);
 
-	return next_thread;
+		if (tcb->wakeup_time < next_timeout)
+			next_timeout = tcb->wakeup_time;
+	}
 }
 
-/*
-  Make the process ready.
- */
-int wakeup(TCB* tcb)
-{
-	int ret = 0;
-
-	/* Preemption off */
-	int oldpre = preempt_off;
-
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+/********************************************
 
-	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
-		ret = 1;
-	}
+	Scheduling policies
 
-	Mutex_Unlock(&sched_spinlock);
+ *********************************************/
 
-	/* Restore preemption state */
-	if (oldpre)
-		preempt_on;
+/* Return 1 if a thread may run on the given core */
+static inline int sched_allowed(TCB* tcb, uint c)
+{
+	return bitmap_test(tcb->affinity.bits, c);
+}
 
-	return ret;
+/* Return 1 if a thread may run on every core */
+static inline int sched_unpinned(TCB* tcb)
+{
+	uint n = cpu_cores();
+	for (uint w = 0; w < n/64; w++)
+		if (tcb->affinity.bits[w] != ~UINT64_C(0))
+			return 0;
+	uint64_t mask = (UINT64_C(1) << (n % 64)) - 1;
+	return (tcb->affinity.bits[n/64] & mask) == mask;
 }
 
 /*
-  Atomically put the current process to sleep, after unlocking mx.
- */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
-	TimerDuration timeout)
+  Return the first thread of a run queue that may run on core thief, or
+  the first thread if thief is NULL. Return NULL if there is none.
+*/
+static TCB* sched_first_allowed(rlnode* Q, CCB* thief)
 {
-	assert(state == STOPPED || state == EXITED);
+	rlnode* node = Q->next;
+	if (thief != NULL)
+		while (node != Q && !sched_allowed(node->tcb, thief->id))
+			node = node->next;
+	return (node == Q) ? NULL : node->tcb;
+}
 
 
-	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+/*
+	MLFQ policy.
 
-	/* mark the thread as stopped or exited */
-	tcb->state = state;
+	Threads enter at the top level. A thread that uses up its quantum drops
+	one level, a thread that blocks on I/O rises one level, and any other 
+	voluntary yield returns it to the top level. Every YIELDS yields, all 
+	levels are boosted by one (see sched_queue_catchup()).
+ */
 
-	/* register the timeout (if any) for the sleeping thread */
-	if (state != EXITED)
-		sched_register_timeout(tcb, timeout);
+/* Return the run queue of logical level L on a core */
+static inline rlnode* sched_level(CCB* core, uint L)
+{
+	uint slot = core->queue_base + L;
+	if (slot >= PRIORITY_QUEUES)
+		slot -= PRIORITY_QUEUES;
+	return &core->ready_queue[slot];
+}
 
-	/* Release mx */
-	if (mx != NULL)
-		Mutex_Unlock(mx);
+/*
+  Boost every queued thread of a core by one level, by rotating the ring
+  of run queues. The old top level becomes level 0, after its threads are
+  merged into the new top level, ahead of the threads promoted into it.
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void sched_queue_rotate(CCB* core)
+{
+	rlnode* top = sched_level(core, PRIORITY_QUEUES-1);
+	rlnode* below = sched_level(core, PRIORITY_QUEUES-2);
+	rlist_append(top, below);
+	rlist_append(below, top);
+	core->queue_base = (core->queue_base == 0) ? PRIORITY_QUEUES-1 : core->queue_base-1;
+
+	int top_ready = bitmap_test(core->ready_bitmap, PRIORITY_QUEUES-1);
+	bitmap_shl1(core->ready_bitmap, BITMAP_WORDS(PRIORITY_QUEUES));
+#if PRIORITY_QUEUES % 64
+	bitmap_clear(core->ready_bitmap, PRIORITY_QUEUES);
+#endif
+	if (top_ready)
+		bitmap_set(core->ready_bitmap, PRIORITY_QUEUES-1);
+}
 
-	/* call this to schedule someone else */
-	yield(cause);
+/*
+  Apply to the queues of a core the boosts of all epochs since the last
+  time they were touched. After PRIORITY_QUEUES-1 boosts every thread is 
+  at the top level, so the work is bounded.
 
-	/* Restore preemption state */
-	if (preempt)
-		preempt_on;
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void sched_queue_catchup(CCB* core)
+{
+	unsigned long epoch = boost_epoch;
+	unsigned long missed = epoch - core->boost_epoch;
+	core->boost_epoch = epoch;
+
+	if (core->ready_count == 0)
+		return;
+	if (missed > PRIORITY_QUEUES-1)
+		missed = PRIORITY_QUEUES-1;
+	while (missed--)
+		sched_queue_rotate(core);
 }
 
-// Function boost threads, boosts threads that are down in priority, starting at priority = 0, after 10 yields. This happens by finding 
-// threads and adding 1 to their priority.
-void boost_threads(){
-	for(int i=0; i<PRIORITY_QUEUES; i++){
-		for(int j = 0; j<rlist_len(&SCHED[i]); j++){
-			rlnode* thr = rlist_pop_front(&SCHED[i]);
-			if(thr->tcb != NULL){
-				thr->tcb->priority += 1;
-				rlist_push_back(&SCHED[i+1], thr);
-			}
-		}
-	}
+static void mlfq_init(CCB* core)
+{
+	memset(core->ready_bitmap, 0, sizeof(core->ready_bitmap));
+	core->queue_base = 0;
+	core->yield_count = 0;
+	core->boost_epoch = 0;
 }
 
-/* This function is the entry point to the scheduler's context switching */
-
-
-void yield(enum SCHED_CAUSE cause)
+/* Add TCB to the end of the run queue of its priority level */
+static void mlfq_enqueue(CCB* core, TCB* tcb)
 {
+	sched_queue_catchup(core);
+	rlist_push_back(sched_level(core, tcb->priority), &tcb->sched_node);
+	bitmap_set(core->ready_bitmap, tcb->priority);
+}
 
-	numof_yield_calls = numof_yield_calls + 1;
-
-	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
-
-	/* We must stop preemption but save it! */
-	int preempt = preempt_off;
-
-
-
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
-
-	Mutex_Lock(&sched_spinlock);
-
-	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
-		current->state = READY;
-
-	/* Update CURTHREAD scheduler data */
-	current->rts = remaining;
-	current->last_cause = current->curr_cause;
-	current->curr_cause = cause;
-
-	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
-
-	// Time to do some boosting...
-	if(numof_yield_calls > YIELDS){
-		boost_threads();
-		numof_yield_calls =0;
-	}
+/* Remove the first allowed thread of the highest non-empty level */
+static TCB* mlfq_select(CCB* core, CCB* thief)
+{
+	sched_queue_catchup(core);
 
+	int level = bitmap_find_last(core->ready_bitmap, BITMAP_WORDS(PRIORITY_QUEUES));
+	assert(level >= 0); /* else, ready_count was wrong */
 
-	/* Get next */
-	TCB* next = sched_queue_select(current);
-	assert(next != NULL);
+	for (; level >= 0; level--) {
+		if (!bitmap_test(core->ready_bitmap, level))
+			continue;
 
-	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+		rlnode* Q = sched_level(core, level);
+		TCB* tcb = sched_first_allowed(Q, thief);
+		if (tcb == NULL)
+			continue;
 
-	Mutex_Unlock(&sched_spinlock);
+		rlist_remove(&tcb->sched_node);
+		if (is_rlist_empty(Q))
+			bitmap_clear(core->ready_bitmap, level);
 
-	/* Switch contexts */
-	if (current != next) {
-		CURTHREAD = next;
-		cpu_swap_context(&current->context, &next->context);
+		/* The thread may have been boosted while it was queued */
+		tcb->priority = level;
+		return tcb;
 	}
+	return NULL;
+}
 
+/* The MLFQ rules, applied to the given priority */
+static int mlfq_adjust(int priority, enum SCHED_CAUSE cause)
+{
 	switch(cause){
 	
 	// When the cause is SCHED_QUANTUM, it means that the thread hasn't completed its task in the given quantum and must give up place and reduce priority by 1
 	case (SCHED_QUANTUM):
-		if(current->priority > 0)
-			current->priority = current->priority - 1;
-		//else current->priority = 0;
+		if(priority > 0)
+			priority = priority - 1;
 		break;
 
 	// When the cause is SCHED_IO, it means that we have a thread waiting for I/O, which means that it will take a little time, and so give it a higher priority
 	case (SCHED_IO): 
-		if(current->priority < PRIORITY_QUEUES)
-			current->priority = current->priority + 1;
-		//else current->priority = PRIORITY_QUEUES;
+		if(priority < PRIORITY_QUEUES-1)
+			priority = priority + 1;
 	break;
 
-	// When i have SCHED_MUTEX, it means that my high priority thread wants a mutex that is currently used by a low priority thread, meaning that i have to decrease
-	// the high-priority thread so that i give the low-priority thread a chance to finish and release the wanted mutex
+	// When i have SCHED_MUTEX, my thread wants a mutex that is held by another thread. The holder has inherited
+	// my priority (see Mutex_Lock), so there is no need to drop my own priority to let it finish
 	case(SCHED_MUTEX):
-		if(current->priority > 0) //&& current->priority>0)
-		//if((current->curr_cause = current->last_cause) == SCHED_MUTEX)
-			current->priority = current->priority - 1;
-		//else current->priority = 0;
 	break;
 
+	// A real-time thread took the core, this is not the thread's doing
+	case(SCHED_PREEMPT):
+	break;
+
+	// Any other cause: the thread gave up the core voluntarily, return it to the top level
 	default:
-	for(current->priority = 0; current->priority<PRIORITY_QUEUES; current->priority++)
-		current->priority = current->priority;
+		priority = PRIORITY_QUEUES-1;
 	break;
 	}
+	return priority;
+}
+
+/*
+  While a thread has inherited a priority, the rules apply to its own
+  priority, kept in pi_saved, and the thread does not drop below the
+  inherited level.
+*/
+static void mlfq_on_yield(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran)
+{
+	if (tcb->pi_saved < 0) {
+		tcb->priority = mlfq_adjust(tcb->priority, cause);
+		return;
+	}
 
-	/* This is where we get after we are switched back on! A long time
-	   may have passed. Start a new timeslice...
-	  */
-	gain(preempt);
+	tcb->pi_saved = mlfq_adjust(tcb->pi_saved, cause);
+	tcb->priority = (tcb->pi_saved > tcb->pi_level) ? tcb->pi_saved : tcb->pi_level;
 }
 
+static void mlfq_on_wakeup(CCB* core, TCB* tcb) { }
 
+static void mlfq_tick(CCB* core)
+{
+	// Time to do some boosting... every core catches up on its own
+	if(++core->yield_count > YIELDS){
+		__atomic_fetch_add(&boost_epoch, 1, __ATOMIC_RELAXED);
+		core->yield_count = 0;
+	}
+}
 
 /*
-  This function must be called at the beginning of each new timeslice.
-  This is done mostly from inside yield().
-  However, for threads that are executed for the first time, this
-  has to happen in thread_start.
+  Raise the thread to the level of the waiter. A queued thread is moved
+  up in the run queues; its current level is found by walking its queue 
+  to the list head.
+*/
+static void mlfq_inherit(CCB* core, TCB* tcb, TCB* waiter)
+{
+	int level = waiter->priority;
+	rlnode* head = NULL;
+
+	if (core != NULL) {
+		sched_queue_catchup(core);
+
+		head = tcb->sched_node.next;
+		while (head->obj != NULL)
+			head = head->next;
+		int cur = (head - core->ready_queue) - (int)core->queue_base;
+		tcb->priority = (cur < 0) ? cur + PRIORITY_QUEUES : cur;
+	}
+
+	/* Remember the level even if the thread is above it, so that it does not drop below */
+	if (tcb->pi_saved < 0)
+		tcb->pi_saved = tcb->priority;
+	if (tcb->pi_level < level)
+		tcb->pi_level = level;
+
+	if (tcb->priority >= level)
+		return;
+
+	if (core != NULL) {
+		rlist_remove(&tcb->sched_node);
+		if (is_rlist_empty(head))
+			bitmap_clear(core->ready_bitmap, tcb->priority);
+		tcb->priority = level;
+		mlfq_enqueue(core, tcb);
+	}
+	else
+		tcb->priority = level;
+}
+
+static void mlfq_restore(TCB* tcb)
+{
+	tcb->priority = tcb->pi_saved;
+}
+
+const sched_ops sched_mlfq_ops = {
+	.name = "mlfq",
+	.init = mlfq_init,
+	.enqueue = mlfq_enqueue,
+	.select = mlfq_select,
+	.on_yield = mlfq_on_yield,
+	.on_wakeup = mlfq_on_wakeup,
+	.tick = mlfq_tick,
+	.inherit = mlfq_inherit,
+	.restore = mlfq_restore
+};
+
+
+/*
+	Round-robin policy.
+
+	The ready threads of a core form one FIFO queue, and each runs for
+	a quantum in turn. There are no priorities; priority inheritance lends 
+	the holder of a lock the turn of the waiter. The holder goes to the 
+	front of its queue, and returns there when preempted, until it releases
+	its last lock. The waiter, woken by the unlock, gets its turn back at
+	the front.
+ */
+
+static void rr_init(CCB* core) { }
+
+static void rr_enqueue(CCB* core, TCB* tcb)
+{
+	if (tcb->pi_saved >= 0 || (tcb->woken && tcb->curr_cause == SCHED_MUTEX))
+		rlist_push_front(&core->ready_queue[0], &tcb->sched_node);
+	else
+		rlist_push_back(&core->ready_queue[0], &tcb->sched_node);
+}
+
+static TCB* rr_select(CCB* core, CCB* thief)
+{
+	TCB* tcb = sched_first_allowed(&core->ready_queue[0], thief);
+	if (tcb != NULL)
+		rlist_remove(&tcb->sched_node);
+	return tcb;
+}
+
+static void rr_on_yield(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran) { }
+
+static void rr_on_wakeup(CCB* core, TCB* tcb) { }
+
+static void rr_tick(CCB* core) { }
+
+static void rr_inherit(CCB* core, TCB* tcb, TCB* waiter)
+{
+	if (tcb->pi_saved < 0)
+		tcb->pi_saved = tcb->priority;
+	if (core != NULL) {
+		rlist_remove(&tcb->sched_node);
+		rlist_push_front(&core->ready_queue[0], &tcb->sched_node);
+	}
+}
+
+static void rr_restore(TCB* tcb) { }
+
+const sched_ops sched_rr_ops = {
+	.name = "rr",
+	.init = rr_init,
+	.enqueue = rr_enqueue,
+	.select = rr_select,
+	.on_yield = rr_on_yield,
+	.on_wakeup = rr_on_wakeup,
+	.tick = rr_tick,
+	.inherit = rr_inherit,
+	.restore = rr_restore
+};
+
+
+/*
+	CFS policy.
+
+	Each thread accumulates virtual runtime as it runs, and the thread with
+	the least virtual runtime runs next. The run queue of a core is kept 
+	sorted by virtual runtime. Threads are inserted from the back, since a 
+	thread that has just run usually has the largest virtual runtime.
+
+	The virtual time of a core, min_vruntime, follows the virtual runtime 
+	of the threads it selects. The virtual runtime of a thread is relative 
+	to the core it last ran on, and it is rebased when the thread moves to
+	another core. A thread that wakes up after a long sleep is put at most
+	CFS_WAKEUP_CREDIT behind the virtual time of its core, so that it runs
+	soon, but cannot monopolize the core.
+
+	Priority inheritance lends the holder of a lock the virtual runtime it
+	has in excess of the waiter's, to be paid back at sched_restore_priority().
+ */
+
+#define CFS_WAKEUP_CREDIT QUANTUM
+
+static void cfs_init(CCB* core)
+{
+	core->min_vruntime = 0;
+}
+
+/* Make the virtual runtime of a thread relative to a new core */
+static void cfs_rebase(TCB* tcb, CCB* core)
+{
+	if (tcb->last_core == core->id)
+		return;
+
+	TimerDuration from = cctx[tcb->last_core].min_vruntime;
+	TimerDuration to = core->min_vruntime;
+	if (tcb->vruntime >= from)
+		tcb->vruntime = to + (tcb->vruntime - from);
+	else
+		tcb->vruntime = (to > from - tcb->vruntime) ? to - (from - tcb->vruntime) : 0;
+	tcb->last_core = core->id;
+}
+
+static void cfs_enqueue(CCB* core, TCB* tcb)
+{
+	cfs_rebase(tcb, core);
+
+	rlnode* Q = &core->ready_queue[0];
+	rlnode* pos = Q->prev;
+	while (pos != Q && pos->tcb->vruntime > tcb->vruntime)
+		pos = pos->prev;
+	rl_splice(pos, &tcb->sched_node);
+}
+
+static TCB* cfs_select(CCB* core, CCB* thief)
+{
+	TCB* tcb = sched_first_allowed(&core->ready_queue[0], thief);
+	if (tcb == NULL)
+		return NULL;
+
+	rlist_remove(&tcb->sched_node);
+	if (thief != NULL)
+		cfs_rebase(tcb, thief);
+	else if (tcb->vruntime > core->min_vruntime)
+		core->min_vruntime = tcb->vruntime;
+	return tcb;
+}
+
+static void cfs_on_yield(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran)
+{
+	tcb->vruntime += ran;
+}
+
+static void cfs_on_wakeup(CCB* core, TCB* tcb)
+{
+	cfs_rebase(tcb, core);
+
+	if (core->min_vruntime > CFS_WAKEUP_CREDIT 
+		&& tcb->vruntime < core->min_vruntime - CFS_WAKEUP_CREDIT)
+		tcb->vruntime = core->min_vruntime - CFS_WAKEUP_CREDIT;
+}
+
+static void cfs_tick(CCB* core) { }
+
+static void cfs_inherit(CCB* core, TCB* tcb, TCB* waiter)
+{
+	if (tcb->vruntime <= waiter->vruntime)
+		return;
+
+	TimerDuration lend = tcb->vruntime - waiter->vruntime;
+	tcb->pi_lent += lend;
+	tcb->pi_saved = 0;
+
+	if (core != NULL) {
+		rlist_remove(&tcb->sched_node);
+		tcb->vruntime -= lend;
+		cfs_enqueue(core, tcb);
+	}
+	else
+		tcb->vruntime -= lend;
+}
+
+static void cfs_restore(TCB* tcb)
+{
+	tcb->vruntime += tcb->pi_lent;
+	tcb->pi_lent = 0;
+}
+
+const sched_ops sched_cfs_ops = {
+	.name = "cfs",
+	.init = cfs_init,
+	.enqueue = cfs_enqueue,
+	.select = cfs_select,
+	.on_yield = cfs_on_yield,
+	.on_wakeup = cfs_on_wakeup,
+	.tick = cfs_tick,
+	.inherit = cfs_inherit,
+	.restore = cfs_restore
+};
+
+/* The policy selected at boot */
+static const sched_ops* policy = &sched_mlfq_ops;
+
+
+/********************************************
+
+	Real-time threads
+
+ *********************************************/
+
+/*
+	Real-time threads form a class of their own, scheduled ahead of the 
+	policy. Each core keeps its ready real-time threads in rt_queue, sorted
+	by the deadline of their current job (EDF). A woken real-time thread 
+	preempts the thread running on its core if that one is not real-time,
+	or has a later deadline, by an ICI.
+
+	The periods of a thread are advanced lazily (see rt_advance()), when 
+	it is made ready, when its time slice ends, and when its job completes.
+	The running time of a thread is charged to its budget when its time 
+	slice ends, and the slice is cut short so that it does not exceed the
+	budget. A thread that uses up its budget is throttled: it sleeps in the
+	timer wheel until its next period.
+ */
+
+/* Total density (budget/deadline) of the real-time threads, in millionths of a core */
+static unsigned long rt_reserved = 0;
+static Spinlock rt_lock = SPINLOCK_INIT;
+
+#define RT_DENSITY(rt) ((rt)->budget * 1000000ul / (rt)->deadline)
+
+/*
+  Add a real-time thread to the real-time run queue of a core, behind 
+  the threads with the same or an earlier deadline.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void rt_enqueue(CCB* core, TCB* tcb)
+{
+	rlnode* Q = &core->rt_queue;
+	rlnode* pos = Q->prev;
+	while (pos != Q && pos->tcb->rt.abs_deadline > tcb->rt.abs_deadline)
+		pos = pos->prev;
+	rl_splice(pos, &tcb->sched_node);
+	tcb->rt.queued = 1;
+	core->rt_count++;
+}
+
+/* Count a deadline miss, if the current job of a thread is late */
+static void rt_check_deadline(CCB* core, TCB* tcb, TimerDuration now)
+{
+	sched_rt* rt = &tcb->rt;
+	if (!rt->done && !rt->missed && now > rt->abs_deadline) {
+		rt->missed = 1;
+		tcb->stats.rt_misses++;
+		core->deadline_misses++;
+	}
+}
+
+/* Move a thread to the period that contains now, starting a new job with a full budget */
+static void rt_advance(TCB* tcb, TimerDuration now)
+{
+	sched_rt* rt = &tcb->rt;
+	if (now < rt->release + rt->period)
+		return;
+
+	rt->release += (now - rt->release) / rt->period * rt->period;
+	rt->abs_deadline = rt->release + rt->deadline;
+	rt->left = rt->budget;
+	rt->done = 0;
+	rt->missed = 0;
+}
+
+/* The start of the next period of a thread */
+static inline TimerDuration rt_next_release(TCB* tcb)
+{
+	return tcb->rt.release + tcb->rt.period;
+}
+
+int sched_rt_admit(const rtparams* params)
+{
+	unsigned long density = RT_DENSITY(params);
+	unsigned long limit = cpu_cores() * RT_UTILIZATION_MAX * 10000ul;
+
+	int preempt = preempt_off;
+	Spinlock_Lock(&rt_lock);
+	int admitted = rt_reserved + density <= limit;
+	if (admitted)
+		rt_reserved += density;
+	Spinlock_Unlock(&rt_lock);
+	if (preempt)
+		preempt_on;
+
+	return admitted ? 0 : -1;
+}
+
+void sched_set_realtime(TCB* tcb, const rtparams* params)
+{
+	sched_rt* rt = &tcb->rt;
+	int preempt = preempt_off;
+
+	if (params != NULL) {
+		rt->period = params->period;
+		rt->budget = params->budget;
+		rt->deadline = params->deadline;
+		rt->release = bios_clock();
+		rt->abs_deadline = rt->release + rt->deadline;
+		rt->left = rt->budget;
+		rt->done = 0;
+		rt->missed = 0;
+		rt->active = 1;
+	}
+	else if (rt->active) {
+		Spinlock_Lock(&rt_lock);
+		rt_reserved -= RT_DENSITY(rt);
+		Spinlock_Unlock(&rt_lock);
+		rt->active = 0;
+	}
+
+	if (preempt)
+		preempt_on;
+}
+
+TimerDuration sched_rt_complete()
+{
+	int preempt = preempt_off;
+	TCB* tcb = CURTHREAD;
+	TimerDuration now = bios_clock();
+
+	assert(tcb->rt.active);
+	rt_check_deadline(&CURCORE, tcb, now);
+	tcb->rt.done = 1;
+	tcb->stats.rt_jobs++;
+
+	/* If the job overran its period, the next one starts now */
+	TimerDuration next = rt_next_release(tcb);
+	if (next <= now) {
+		rt_advance(tcb, now);
+		next = now;
+	}
+
+	if (preempt)
+		preempt_on;
+	return next;
+}
+
+
+/********************************************
+
+	Run queues
+
+ *********************************************/
+
+/*
+  Add TCB to the run queues of the given core.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void sched_queue_add_locked(TCB* tcb, CCB* core)
+{
+	if (tcb->rt.active)
+		rt_enqueue(core, tcb);
+	else {
+		if (tcb->woken)
+			policy->on_wakeup(core, tcb);
+		policy->enqueue(core, tcb);
+	}
+	core->ready_count++;
+	tcb->stealable = sched_unpinned(tcb);
+	if (tcb->stealable)
+		core->stealable_count++;
+	tcb->last_core = core->id;
+}
+
+/* Return 1 if a core is halted in its idle loop */
+static inline int sched_core_idle(uint c)
+{
+	return bitmap_test(idle_cores, c);
+}
+
+/*
+  Interrupt some idle core other than the current one, if one exists.
+  Returns 1 if a core was woken up.
+
+  As with cpu_core_restart_one(), only cores that have a host processor
+  of their own are woken up; on an oversubscribed host, waking the rest 
+  just makes the cores compete for the processors.
+*/
+static int sched_wake_idle_core()
+{
+	uint ncores = cpu_cores();
+	if (ncores > cpu_physical_cores())
+		ncores = cpu_physical_cores();
+
+	for (uint w = 0; w < BITMAP_WORDS(ncores); w++) {
+		uint64_t mask = __atomic_load_n(&idle_cores[w], __ATOMIC_RELAXED);
+		while (mask) {
+			uint c = w*64 + __builtin_ctzll(mask);
+			uint64_t bit = UINT64_C(1) << (c & 63);
+			mask &= ~bit;
+			if (c >= ncores) break;
+			if (c == cpu_core_id) continue;
+			if (__atomic_fetch_and(&idle_cores[w], ~bit, __ATOMIC_ACQ_REL) & bit) {
+				cpu_ici(c);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+  Choose the core whose run queues a ready thread should join.
+
+  Soft affinity: the core the thread last ran on is preferred, since its 
+  caches are probably still warm, unless that core is idle and cannot be
+  woken up cheaply (see sched_wake_idle_core()). Then the current core is
+  preferred. Hard affinity: the thread only goes to a core in its mask.
+*/
+static CCB* sched_place(TCB* tcb)
+{
+	uint self = cpu_core_id;
+	uint last = tcb->last_core;
+
+	if (last != self && last < cpu_cores() && sched_allowed(tcb, last)
+		&& (last < cpu_physical_cores() || !sched_core_idle(last)))
+		return &cctx[last];
+
+	if (sched_allowed(tcb, self))
+		return &cctx[self];
+
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (sched_allowed(tcb, c))
+			return &cctx[c];
+
+	assert(0); /* the affinity must contain some core */
+	return &cctx[self];
+}
+
+/*
+  Add TCB to the run queues of a core.
+
+  Note: the caller must be in the non-preemptive domain, and hold no
+  core's sched_lock.
+*/
+static void sched_queue_add(TCB* tcb, CCB* core)
+{
+	Spinlock_Lock(&core->sched_lock);
+	sched_queue_add_locked(tcb, core);
+	Spinlock_Unlock(&core->sched_lock);
+
+	/* If the thread went to an idle core, wake up that one */
+	uint c = core->id;
+	if (c != cpu_core_id) {
+		uint64_t bit = UINT64_C(1) << (c & 63);
+		if (__atomic_fetch_and(&idle_cores[c/64], ~bit, __ATOMIC_ACQ_REL) & bit) {
+			cpu_ici(c);
+			return;
+		}
+	}
+
+	/* A woken real-time thread preempts a later deadline, or a thread that is not real-time */
+	if (tcb->rt.active && tcb->woken && tcb->rt.abs_deadline < core->rt_running) {
+		core->rt_preempt = 1;
+		cpu_ici(c);
+		return;
+	}
+
+	/* Wake up an idle core, it may steal this thread */
+	sched_wake_idle_core();
+}
+
+/*
+	Adjust the state of a thread to make it READY.
+
+	*** MUST BE CALLED WITH sched_spinlock HELD ***
+ */
+static void sched_make_ready(TCB* tcb)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+
+	/* Possibly remove from the timer wheel */
+	if (tcb->wakeup_time != NO_TIMEOUT) {
+		/* tcb is in the wheel, fix it */
+		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		wheel_remove(tcb);
+		tcb->wakeup_time = NO_TIMEOUT;
+	}
+
+	/* A real-time thread with no budget left is throttled until its next period */
+	TimerDuration now = bios_clock();
+	if (tcb->rt.active) {
+		rt_check_deadline(&CURCORE, tcb, now);
+		rt_advance(tcb, now);
+		if (tcb->rt.left == 0) {
+			tcb->stats.rt_throttles++;
+			tcb->state = STOPPED;
+			sched_register_timeout(tcb, rt_next_release(tcb) - now);
+			return;
+		}
+	}
+
+	/* Mark as ready */
+	tcb->state = READY;
+	tcb->ready_since = now;
+	tcb->woken = 1;
+
+	/* Possibly add to the scheduler queues */
+	if (tcb->phase == CTX_CLEAN)
+		sched_queue_add(tcb, sched_place(tcb));
+}
+
+/*
+  Advance the timer wheel to the current time, and wake up all the
+  threads whose timeout has expired, as a batch.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_wakeup_expired_timeouts()
+{
+	rlnode expired;
+	rlnode_init(&expired, NULL);
+	wheel_advance(bios_clock(), &expired);
+
+	while (!is_rlist_empty(&expired)) {
+		TCB* tcb = rlist_pop_front(&expired)->tcb;
+		tcb->wakeup_time = NO_TIMEOUT; /* already out of the wheel */
+		sched_make_ready(tcb);
+	}
+
+	uint64_t next = wheel_next_tick();
+	next_timeout = (next == (uint64_t)-1) ? NO_TIMEOUT : next << WHEEL_TICK_SHIFT;
+}
+
+/*
+  Account for a thread removed from the queues of a core.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void sched_queue_removed(CCB* core, TCB* tcb)
+{
+	core->ready_count--;
+	if (tcb->stealable) {
+		core->stealable_count--;
+		tcb->stealable = 0;
+	}
+}
+
+/*
+  Remove the next thread to run from the queues of a core, and return it.
+  Return NULL if the queues are empty.
+
+  If thief is not NULL, only a thread allowed to run on core thief is 
+  removed, and NULL is returned if there is none.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static TCB* sched_queue_pop_locked(CCB* core, CCB* thief)
+{
+	TCB* tcb;
+
+	/* Real-time threads come first */
+	if (core->rt_count > 0) {
+		tcb = sched_first_allowed(&core->rt_queue, thief);
+		if (tcb != NULL) {
+			rlist_remove(&tcb->sched_node);
+			tcb->rt.queued = 0;
+			core->rt_count--;
+			sched_queue_removed(core, tcb);
+			return tcb;
+		}
+	}
+
+	if (core->ready_count == core->rt_count)
+		return NULL;
+
+	tcb = policy->select(core, thief);
+	if (tcb != NULL)
+		sched_queue_removed(core, tcb);
+	return tcb;
+}
+
+/*
+  Steal a thread that may run on the thief from the core with the most
+  ready threads. Return NULL if there is none.
+*/
+static TCB* sched_steal(CCB* thief)
+{
+	CCB* victim = NULL;
+	uint most = 0;
+
+	/* Unlocked scan, the counts are just a hint */
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* peer = &cctx[c];
+		if (peer != thief && peer->ready_count > most) {
+			most = peer->ready_count;
+			victim = peer;
+		}
+	}
+
+	if (victim == NULL)
+		return NULL;
+
+	Spinlock_Lock(&victim->sched_lock);
+	TCB* tcb = sched_queue_pop_locked(victim, thief);
+	Spinlock_Unlock(&victim->sched_lock);
+	return tcb;
+}
+
+/*
+  Select the next thread to run on this core. 
+
+  The local queues are tried first. A thread found there that may not run
+  on this core (its affinity changed while it was queued) is moved to an 
+  allowed core. If the queues are empty, the current thread continues if 
+  it is still ready and allowed here. Otherwise, before settling for the 
+  idle thread, a thread is stolen from the busiest peer.
+*/
+static TCB* sched_queue_select(TCB* current)
+{
+	CCB* core = &CURCORE;
+	TCB* next_thread;
+	int current_ok = current->state == READY && sched_allowed(current, core->id);
+
+	for (;;) {
+		Spinlock_Lock(&core->sched_lock);
+		/* 
+		   A real-time thread continues, unless a thread with an earlier deadline is 
+		   queued, or it waits for a lock, whose holder should run instead.
+		 */
+		if (current_ok && current->rt.active && current->curr_cause != SCHED_MUTEX 
+			&& (core->rt_count == 0 
+			|| core->rt_queue.next->tcb->rt.abs_deadline >= current->rt.abs_deadline))
+			next_thread = current;
+		else
+			next_thread = sched_queue_pop_locked(core, NULL);
+		Spinlock_Unlock(&core->sched_lock);
+
+		if (next_thread == NULL || sched_allowed(next_thread, core->id))
+			break;
+		sched_queue_add(next_thread, sched_place(next_thread));
+	}
+
+	if (next_thread == NULL && current_ok && current->type != IDLE_THREAD)
+		next_thread = current;
+
+	if (next_thread == NULL)
+		next_thread = sched_steal(core);
+
+	if (next_thread == NULL)
+		next_thread = current_ok ? current : &core->idle_thread;
+
+	next_thread->its = QUANTUM;
+
+	return next_thread;
+}
+
+void sched_inherit_priority(void** owner)
+{
+	int preempt = preempt_off;
+	TCB* waiter = CURTHREAD;
+
+	Spinlock_Lock(&pi_lock);
+	TCB* tcb = __atomic_load_n(owner, __ATOMIC_ACQUIRE);
+
+	if (tcb != NULL && tcb != waiter && tcb->type != IDLE_THREAD) {
+		/* A READY thread that is linked is in the run queues of its last core */
+		CCB* core = &cctx[tcb->last_core];
+		Spinlock_Lock(&core->sched_lock);
+		int queued = tcb->state == READY && tcb->last_core == core->id 
+			&& tcb->sched_node.next != &tcb->sched_node;
+		/* Real-time threads are ahead of any priority */
+		policy->inherit((queued && !tcb->rt.queued) ? core : NULL, tcb, waiter);
+
+		/* Make sure that the holder hands the lock off to a real-time waiter */
+		if (waiter->rt.active && tcb->pi_saved < 0)
+			tcb->pi_saved = tcb->priority;
+		Spinlock_Unlock(&core->sched_lock);
+	}
+
+	Spinlock_Unlock(&pi_lock);
+	if (preempt)
+		preempt_on;
+}
+
+void sched_restore_priority(TCB* tcb)
+{
+	int preempt = preempt_off;
+	Spinlock_Lock(&pi_lock);
+	if (tcb->pi_saved >= 0) {
+		policy->restore(tcb);
+		tcb->pi_saved = -1;
+		tcb->pi_level = -1;
+	}
+	Spinlock_Unlock(&pi_lock);
+	if (preempt)
+		preempt_on;
+}
+
+int sched_thread_running(TCB* tcb)
+{
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (__atomic_load_n(&cctx[c].current_thread, __ATOMIC_RELAXED) == tcb)
+			return 1;
+	return 0;
+}
+
+void sched_set_affinity(TCB* tcb, const coreset_t* set)
+{
+	int preempt = preempt_off;
+	tcb->affinity = *set;
+	int move = (tcb == CURTHREAD) && !sched_allowed(tcb, cpu_core_id);
+	if (preempt)
+		preempt_on;
+
+	/* gain() will place us on an allowed core */
+	if (move)
+		yield(SCHED_USER);
+}
+
+/*
+  Make the process ready.
+ */
+int wakeup(TCB* tcb)
+{
+	int ret = 0;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	/* To touch tcb->state, we must get the spinlock. */
+	Spinlock_Lock(&sched_spinlock);
+
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		sched_make_ready(tcb);
+		ret = 1;
+	}
+
+	Spinlock_Unlock(&sched_spinlock);
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+/*
+  Atomically put the current process to sleep, after unlocking sl and mx.
+ */
+void sleep_releasing(Thread_state state, Spinlock* sl, Mutex* mx, 
+	enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	assert(state == STOPPED || state == EXITED);
+
+
+	int preempt = preempt_off;
+	TCB* tcb = CURTHREAD;
+	Spinlock_Lock(&sched_spinlock);
+
+	/* mark the thread as stopped or exited */
+	tcb->state = state;
+
+	/* register the timeout (if any) for the sleeping thread */
+	if (state != EXITED)
+		sched_register_timeout(tcb, timeout);
+
+	/* Release the schduler spinlock before calling yield() !!! */
+	Spinlock_Unlock(&sched_spinlock);
+
+	/* 
+	   Release sl and mx. We are already marked as sleeping, so a wakeup is 
+	   not lost. This is done without sched_spinlock, since unlocking a mutex
+	   with parked waiters wakes one of them up.
+	 */
+	if (sl != NULL)
+		Spinlock_Unlock(sl);
+	if (mx != NULL)
+		Mutex_Unlock(mx);
+
+	/* call this to schedule someone else */
+	yield(cause);
+
+	/* Restore preemption state */
+	if (preempt)
+		preempt_on;
+}
+
+/*
+  Scheduler accounting.
+
+  The time of each slice is charged to the thread, and to the priority 
+  level it ran at. When a thread starts running, the time since it became
+  READY is charged as waiting time. If it became READY by a wakeup, the 
+  wait is also the wakeup latency, recorded in the histogram of the core.
+*/
+
+/* The histogram bucket of a latency, see schedinfo */
+static inline uint latency_bucket(TimerDuration usec)
+{
+	uint b = (usec == 0) ? 0 : 64 - __builtin_clzll(usec);
+	return (b < SCHEDINFO_BUCKETS) ? b : SCHEDINFO_BUCKETS-1;
+}
+
+/* Charge the slice that ends now to the current thread, and return its length */
+static TimerDuration sched_account_slice(TCB* current, enum SCHED_CAUSE cause, TimerDuration now)
+{
+	TimerDuration ran = (now > current->run_since) ? now - current->run_since : 0;
+	current->stats.runtime += ran;
+	if (current->type == IDLE_THREAD)
+		return ran;
+
+	current->stats.level_time[current->priority] += ran;
+	if (cause == SCHED_QUANTUM || cause == SCHED_PREEMPT)
+		current->stats.involuntary++;
+	else
+		current->stats.voluntary++;
+	return ran;
+}
+
+/* Charge the wait of a thread that starts running on a core */
+static void sched_account_switch(CCB* core, TCB* current, TimerDuration now)
+{
+	core->switches++;
+	if (current->type == IDLE_THREAD)
+		return;
+
+	TimerDuration waited = (now > current->ready_since) ? now - current->ready_since : 0;
+	current->stats.wait_time += waited;
+	if (current->woken) {
+		current->woken = 0;
+		core->wakeups++;
+		core->wakeup_latency[latency_bucket(waited)]++;
+	}
+}
+
+void sched_core_info(uint c, schedinfo* info)
+{
+	CCB* core = &cctx[c];
+	info->core = c;
+	info->switches = core->switches;
+	info->idle_time = core->idle_thread.stats.runtime;
+	info->wakeups = core->wakeups;
+	info->deadline_misses = core->deadline_misses;
+	for (uint i = 0; i < SCHEDINFO_BUCKETS; i++)
+		info->latency[i] = core->wakeup_latency[i];
+}
+
+/* This function is the entry point to the scheduler's context switching */
+
+
+void yield(enum SCHED_CAUSE cause)
+{
+	/* Reset the timer, so that we are not interrupted by ALARM */
+	TimerDuration remaining = bios_cancel_timer();
+
+	/* We must stop preemption but save it! */
+	int preempt = preempt_off;
+
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread; /* Make a local copy of current process, for speed */
+
+	/* Account for the time slice that ends, and let the policy adjust the thread */
+	TimerDuration now = bios_clock();
+	TimerDuration ran = sched_account_slice(current, cause, now);
+	if (current->type != IDLE_THREAD)
+		policy->on_yield(current, cause, ran);
+
+	/* 
+	   Update CURTHREAD state. A RUNNING thread is not touched by wakeup() or 
+	   any other core, so we do not need sched_spinlock here.
+	 */
+	if (current->state == RUNNING)
+		current->state = READY;
+
+	/* Update CURTHREAD scheduler data */
+	current->rts = remaining + core->slice_left;
+	current->last_cause = current->curr_cause;
+	current->curr_cause = cause;
+
+	/* Charge a real-time thread's budget, and throttle it if the budget is used up */
+	if (current->rt.active) {
+		current->rt.left -= (ran < current->rt.left) ? ran : current->rt.left;
+		rt_check_deadline(core, current, now);
+		rt_advance(current, now);
+		if (current->state == READY && current->rt.left == 0) {
+			current->stats.rt_throttles++;
+			Spinlock_Lock(&sched_spinlock);
+			current->state = STOPPED;
+			sched_register_timeout(current, rt_next_release(current) - now);
+			Spinlock_Unlock(&sched_spinlock);
+		}
+	}
+
+	/* Wake up threads whose sleep timeout has expired */
+	if (next_timeout <= now) {
+		Spinlock_Lock(&sched_spinlock);
+		sched_wakeup_expired_timeouts();
+		Spinlock_Unlock(&sched_spinlock);
+	}
+
+	policy->tick(core);
+
+	/* Get next */
+	TCB* next = sched_queue_select(current);
+	assert(next != NULL);
+
+	/* Save the current TCB for the gain phase */
+	core->previous_thread = current;
+
+	/* Switch contexts */
+	if (current != next) {
+		core->current_thread = next;
+		cpu_swap_context(&current->context, &next->context);
+	}
+
+	/* This is where we get after we are switched back on! A long time
+	   may have passed. Start a new timeslice...
+	  */
+	gain(preempt);
+}
+
+
+
+/*
+  Program the core timer for the next time slice of the given length,
+  or for the earliest sleep deadline, if that comes first. In the latter
+  case, the remainder of the slice is kept in core->slice_left.
+*/
+static void sched_arm_timer(CCB* core, TimerDuration slice)
+{
+	TimerDuration deadline = next_timeout;
+	core->slice_left = 0;
+
+	if (deadline != NO_TIMEOUT) {
+		TimerDuration now = bios_clock();
+		TimerDuration until = (deadline > now) ? deadline - now : 1;
+		if (until < slice) {
+			core->slice_left = slice - until;
+			slice = until;
+		}
+	}
+	bios_set_timer(slice);
+}
+
+/* 
+  Interrupt handler for ALARM. 
+
+  If the alarm was for a sleep deadline, the expired threads are woken 
+  up and the current thread continues its slice. Otherwise, the quantum 
+  has expired.
+*/
+void yield_handler()
+{
+	CCB* core = &CURCORE;
+
+	if (core->slice_left == 0) {
+		yield(SCHED_QUANTUM);
+		return;
+	}
+
+	int preempt = preempt_off;
+	Spinlock_Lock(&sched_spinlock);
+	sched_wakeup_expired_timeouts();
+	Spinlock_Unlock(&sched_spinlock);
+	sched_arm_timer(core, core->slice_left);
+	if (preempt)
+		preempt_on;
+}
+
+/*
+  This function must be called at the beginning of each new timeslice.
+  This is done mostly from inside yield().
+  However, for threads that are executed for the first time, this
+  has to happen in thread_start.
 
   The 'preempt' argument determines whether preemption is turned on
   in the new timeslice. When returning to threads in the non-preemptive
@@ -538,42 +1875,87 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
-	TCB* current = CURTHREAD;
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread;
 
 	/* Mark current state */
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->last_core = core->id;
+
+	/* A real-time thread may not run beyond its budget */
+	if (current->rt.active) {
+		if (current->rts > current->rt.left)
+			current->rts = (current->rt.left > 0) ? current->rt.left : 1;
+		core->rt_running = current->rt.abs_deadline;
+	}
+	else
+		core->rt_running = NO_TIMEOUT;
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = core->previous_thread;
+	TimerDuration now = bios_clock();
+	current->run_since = now;
 	if (current != prev) {
-		prev->phase = CTX_CLEAN;
+		sched_account_switch(core, current, now);
+
 		switch (prev->state) {
 		case READY:
+			/* 
+			   A READY thread with a dirty context is in no queue, and 
+			   wakeup() ignores it. Nobody else can touch it.
+			 */
+			prev->phase = CTX_CLEAN;
+			prev->ready_since = now;
+			prev->woken = 0;
 			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+				sched_queue_add(prev, sched_place(prev));
 			break;
 		case EXITED:
 			release_TCB(prev);
 			break;
 		case STOPPED:
+			/* 
+			   A concurrent wakeup() may be making prev READY, we need to
+			   synchronize with it.
+			 */
+			Spinlock_Lock(&sched_spinlock);
+			prev->phase = CTX_CLEAN;
+			if (prev->state == READY)
+				sched_queue_add(prev, sched_place(prev));
+			Spinlock_Unlock(&sched_spinlock);
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
-
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* Set a 1-quantum alarm, or an earlier one for the next sleep deadline */
+	sched_arm_timer(core, current->rts);
+}
+
+/*
+  Return 1 if this core may find something to do: a ready thread in its
+  own queues or one that it may steal, or an expired sleep deadline.
+
+  Only threads that may run on every core are counted in the queues of
+  the peers. Otherwise, an idle core whose peers only have threads pinned
+  elsewhere would never halt. A thread placed on this core brings an ICI
+  (see sched_queue_add()).
+*/
+static int sched_work_pending(CCB* core)
+{
+	if (core->ready_count > 0)
+		return 1;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (cctx[c].stealable_count > 0)
+			return 1;
+	return next_timeout <= bios_clock();
 }
 
 static void idle_thread()
@@ -581,27 +1963,105 @@ static void idle_thread()
 	/* When we first start the idle thread */
 	yield(SCHED_IDLE);
 
-	/* We come here whenever we cannot find a ready thread for our core */
+	/* 
+	   We come here whenever we cannot find a ready thread for our core,
+	   not even by stealing from the other cores (see sched_queue_select).
+
+	   The core is marked idle before the final check for work, with 
+	   interrupts disabled. Any work that appears after the check comes 
+	   with an ICI, which stays pending and ends the halt at once. The core
+	   timer is set for the next sleep deadline, or not at all, so an idle
+	   core does not wake up unless there is something to do.
+	 */
+	CCB* core = &CURCORE;
+	uint64_t idle_bit = UINT64_C(1) << (core->id & 63);
+	uint64_t* idle_word = &idle_cores[core->id / 64];
+
 	while (active_threads > 0) {
-		cpu_core_halt();
+		preempt_off;
+		__atomic_fetch_or(idle_word, idle_bit, __ATOMIC_ACQ_REL);
+
+		if (!sched_work_pending(core)) {
+			TimerDuration deadline = next_timeout;
+			core->slice_left = 0;
+			if (deadline == NO_TIMEOUT)
+				bios_cancel_timer();
+			else {
+				TimerDuration now = bios_clock();
+				bios_set_timer((deadline > now) ? deadline - now : 1);
+			}
+			cpu_core_halt();
+		}
+
+		__atomic_fetch_and(idle_word, ~idle_bit, __ATOMIC_ACQ_REL);
+		preempt_on;
 		yield(SCHED_IDLE);
 	}
 
-	/* If the idle thread exits here, we are leaving the scheduler! */
+	/* 
+	   If the idle thread exits here, we are leaving the scheduler! Another
+	   core may have seen the last thread alive and be about to halt, with 
+	   no timer set. An ICI stays pending and ends its halt.
+	 */
 	bios_cancel_timer();
-	cpu_core_restart_all();
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (c != core->id)
+			cpu_ici(c);
 }
 
 /*
   Initialize the scheduler queue
  */
-void initialize_scheduler()
+void initialize_scheduler(sched_policy pol)
 {
-	for(int i=0; i<PRIORITY_QUEUES; i++){
-		rlnode_init(&SCHED[i], NULL);
+	static const sched_ops* policies[SCHED_POLICIES] = {
+		[SCHED_POLICY_MLFQ] = &sched_mlfq_ops,
+		[SCHED_POLICY_RR] = &sched_rr_ops,
+		[SCHED_POLICY_CFS] = &sched_cfs_ops
+	};
+	policy = policies[pol];
+	boost_epoch = 0;
+
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		core->sched_lock = SPINLOCK_INIT;
+		for(int i=0; i<PRIORITY_QUEUES; i++)
+			rlnode_init(&core->ready_queue[i], NULL);
+		core->ready_count = 0;
+		core->stealable_count = 0;
+		policy->init(core);
+		rlnode_init(&core->rt_queue, NULL);
+		core->rt_count = 0;
+		core->rt_running = NO_TIMEOUT;
+		core->rt_preempt = 0;
+		core->deadline_misses = 0;
+		for (uint i = 0; i < THREAD_STACK_CLASSES; i++)
+			rlnode_init(&core->thread_cache[i], NULL);
+		core->thread_cache_bytes = 0;
+		core->current_thread = NULL;
+		core->id = c;
+		core->switches = 0;
+		core->wakeups = 0;
+		memset(core->wakeup_latency, 0, sizeof(core->wakeup_latency));
+	}
+	for (uint i = 0; i < THREAD_STACK_CLASSES; i++)
+		rlnode_init(&thread_pool[i], NULL);
+	thread_pool_bytes = 0;
+	rt_reserved = 0;
+
+	for (int l = 0; l < WHEEL_LEVELS; l++) {
+		for (int i = 0; i < WHEEL_SLOTS; i++)
+			rlnode_init(&wheel[l][i], NULL);
+		wheel_bitmap[l] = 0;
 	}
+	rlnode_init(&wheel_overflow, NULL);
+	wheel_now = bios_clock() >> WHEEL_TICK_SHIFT;
+	next_timeout = NO_TIMEOUT;
+}
 
-	rlnode_init(&TIMEOUT_LIST, NULL);
+void finalize_scheduler()
+{
+	drain_thread_pool();
 }
 
 void run_scheduler()
@@ -620,12 +2080,25 @@ void run_scheduler()
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
+	curcore->idle_thread.priority = 0;
+	curcore->idle_thread.pi_saved = -1;
+	curcore->idle_thread.pi_level = -1;
+	curcore->idle_thread.locks_held = 0;
+	curcore->idle_thread.vruntime = 0;
+	curcore->idle_thread.pi_lent = 0;
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
 
+	CORESET_FILL(&curcore->idle_thread.affinity);
+	curcore->idle_thread.woken = 0;
+	curcore->idle_thread.run_since = bios_clock();
+	memset(&curcore->idle_thread.stats, 0, sizeof(curcore->idle_thread.stats));
+	memset(&curcore->idle_thread.rt, 0, sizeof(curcore->idle_thread.rt));
+	curcore->idle_thread.last_core = curcore->id;
+
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
 	cpu_interrupt_handler(ICI, ici_handler);
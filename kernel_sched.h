@@ -83,6 +83,7 @@ typedef enum {
  */
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
+	SCHED_PREEMPT, /**< @brief A real-time thread took the core */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
 	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
@@ -91,6 +92,42 @@ enum SCHED_CAUSE {
 	SCHED_USER /**< @brief User-space code called yield */
 };
 
+/**
+  @brief Scheduler accounting of a thread.
+
+  All times are in microseconds, as measured by @c bios_clock().
+ */
+typedef struct thread_sched_stats {
+	TimerDuration runtime; /**< @brief Time spent running on a core */
+	TimerDuration wait_time; /**< @brief Time spent @c READY in the run queues */
+	unsigned long voluntary; /**< @brief Time slices that ended by blocking or yielding */
+	unsigned long involuntary; /**< @brief Time slices that ended by preemption */
+	TimerDuration level_time[THREADINFO_LEVELS]; /**< @brief Running time at each MLFQ level */
+	unsigned long rt_jobs; /**< @brief Completed real-time jobs */
+	unsigned long rt_misses; /**< @brief Real-time deadline misses */
+	unsigned long rt_throttles; /**< @brief Times the thread used up its real-time budget */
+} sched_stats;
+
+/**
+  @brief Real-time state of a thread.
+
+  A real-time thread is scheduled earliest-deadline-first, ahead of the
+  scheduling policy. Its periods start at @c release + k*period. 
+  @see CreateRealtimeThread
+ */
+typedef struct thread_sched_rt {
+	int active; /**< @brief Set if the thread is a real-time thread */
+	int queued; /**< @brief Set while the thread is in the real-time run queue of a core */
+	TimerDuration period; /**< @brief The period */
+	TimerDuration budget; /**< @brief The running time allowed per period */
+	TimerDuration deadline; /**< @brief The deadline, relative to the start of a period */
+	TimerDuration release; /**< @brief The start of the current period */
+	TimerDuration abs_deadline; /**< @brief The deadline of the current job */
+	TimerDuration left; /**< @brief The budget left in the current period */
+	int done; /**< @brief Set if the job of the current period has completed */
+	int missed; /**< @brief Set if the job of the current period has missed its deadline */
+} sched_rt;
+
 /**
   @brief The thread control block
 
@@ -103,6 +140,11 @@ typedef struct thread_control_block {
   PTCB* ptcb;
 
   int priority; // Priority for MLFQ
+  int pi_saved; /**< @brief The priority before it was raised by priority inheritance, or -1 */
+  int pi_level; /**< @brief The highest priority lent by priority inheritance, or -1 */
+  int locks_held; /**< @brief The number of mutexes held; inherited priority lasts until this drops to 0 */
+  TimerDuration vruntime; /**< @brief Virtual runtime, for the CFS policy */
+  TimerDuration pi_lent; /**< @brief Virtual runtime lent by priority inheritance, for the CFS policy */
 
 	cpu_context_t context; /**< @brief The thread context */
 	Thread_type type; /**< @brief The type of thread */
@@ -111,7 +153,14 @@ typedef struct thread_control_block {
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
+	size_t stack_size; /**< @brief The size of the stack of this thread, in bytes */
+	size_t stack_used; /**< @brief Stack high-water mark, saved when the thread is released */
+
+	coreset_t affinity; /**< @brief The cores this thread may run on */
+	uint last_core; /**< @brief The core this thread last ran on, or is queued on */
+
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	uint timeout_slot; /**< @brief The timer wheel slot of this thread, valid while @c wakeup_time is set */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
@@ -120,6 +169,13 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	TimerDuration ready_since; /**< @brief The time this thread last became @c READY */
+	TimerDuration run_since; /**< @brief The time the current time-slice started */
+	int woken; /**< @brief Set if the thread became @c READY by a wakeup, rather than by preemption */
+	int stealable; /**< @brief Set while the thread is queued and counted in @c stealable_count of its core */
+	sched_stats stats; /**< @brief Scheduler accounting */
+	sched_rt rt; /**< @brief Real-time parameters and state */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -148,6 +204,10 @@ typedef struct process_thread_control_block {
 
    int refcount;
 
+   size_t stack_size;  /**< @brief The stack size of the thread, kept after it exits */
+   size_t stack_used;  /**< @brief The stack high-water mark, saved when the thread exits */
+   sched_stats stats;  /**< @brief The scheduler accounting, saved when the thread exits */
+
    rlnode ptcb_list_node;
 } PTCB;
 
@@ -158,29 +218,153 @@ typedef struct process_thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The smallest thread stack size, 16 kbytes. */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The number of thread stack sizes.
+
+  Stack sizes are powers of 2, from @c THREAD_STACK_MIN up to
+  @c THREAD_STACK_MAX. A requested size is rounded up to the next one.
+ */
+#define THREAD_STACK_CLASSES 8
+
+/** @brief The largest thread stack size, 2 Mbytes. */
+#define THREAD_STACK_MAX (THREAD_STACK_MIN << (THREAD_STACK_CLASSES-1))
+
+/** @brief Stack high-water marks.
+
+  When @c THREAD_STACK_CANARY is defined (build with @c STACK_CANARY=1), 
+  thread stacks are filled with @c THREAD_STACK_PATTERN when the thread is 
+  created, so that the deepest point reached by the stack can be measured. 
+  This is off by default, since it touches, and so commits, every page of 
+  every stack.
+  @see thread_stack_used
+ */
+#define THREAD_STACK_PATTERN 0x5AFE57AC5AFE57ACull
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief Number of MLFQ priority levels.
+
+  Level @c PRIORITY_QUEUES-1 is the highest priority, level 0 the lowest.
+ */
+#define PRIORITY_QUEUES 80
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a multi-level feedback queue of ready threads, protected by
+  @c sched_lock (with the default policy, see @c sched_ops). A core only takes threads from its own queues, unless they
+  are empty, in which case it steals from the busiest peer.
+
+  The MLFQ levels are stored in a ring: logical level @c L lives in
+  @c ready_queue[(queue_base+L) % PRIORITY_QUEUES]. A priority boost rotates
+  the ring by one level, so that it costs O(1) regardless of the number of
+  queued threads. @c ready_bitmap has bit @c L set iff logical level @c L is
+  non-empty, so that the highest ready level is found with one bit search.
+
+  Each CCB starts on its own cache line (see @c CACHE_LINE_SIZE), since peers
+  read and lock it when they steal work or place threads.
  */
 typedef struct core_control_block {
-	uint id; /**< @brief The core id */
+	_Alignas(CACHE_LINE_SIZE) uint id; /**< @brief The core id */
 
 	TCB* current_thread; /**< @brief Points to the thread currently owning the core */
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Spinlock sched_lock; /**< @brief Spinlock for the run queues of this core */
+	rlnode ready_queue[PRIORITY_QUEUES]; /**< @brief The MLFQ run queues of this core, as a ring */
+	uint64_t ready_bitmap[BITMAP_WORDS(PRIORITY_QUEUES)]; /**< @brief Non-empty logical levels */
+	uint queue_base; /**< @brief Index in @c ready_queue of logical level 0 */
+	volatile uint ready_count; /**< @brief Number of threads in @c ready_queue */
+	volatile uint stealable_count; /**< @brief Number of queued threads that may run on every core */
+	uint yield_count; /**< @brief Yields since this core last advanced the boost epoch */
+	unsigned long boost_epoch; /**< @brief The last boost epoch applied to the queues */
+	TimerDuration min_vruntime; /**< @brief Virtual time of this core, for the CFS policy */
+	rlnode rt_queue; /**< @brief Ready real-time threads of this core, by earliest deadline */
+	uint rt_count; /**< @brief Number of threads in @c rt_queue, also counted in @c ready_count */
+	volatile TimerDuration rt_running; /**< @brief The deadline of the current thread, or @c NO_TIMEOUT if it is not real-time */
+	volatile int rt_preempt; /**< @brief Set when an ICI asks the current thread to give up the core */
+	TimerDuration slice_left; /**< @brief Time slice left when the core timer was set for a sleep deadline, else 0 */
+
+	rlnode thread_cache[THREAD_STACK_CLASSES]; /**< @brief Free thread blocks kept for reuse by this core, per stack size */
+	size_t thread_cache_bytes; /**< @brief Total size of the blocks in @c thread_cache */
+
+	unsigned long switches; /**< @brief Context switches on this core */
+	unsigned long wakeups; /**< @brief Woken threads that started running on this core */
+	unsigned long wakeup_latency[SCHEDINFO_BUCKETS]; /**< @brief Histogram of wakeup-to-run latency, see @c schedinfo */
+	unsigned long deadline_misses; /**< @brief Real-time deadline misses detected on this core */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 
 
+/** @brief A scheduling policy.
+
+  The policy decides the order in which the ready threads of a core run.
+  It is chosen at boot (see @c boot_policy()) and it is the same for all
+  cores. The rest of the scheduler (placement, stealing, affinity, timers
+  and accounting) is common to all policies.
+
+  The MLFQ fields of @c CCB are used by the MLFQ policy. The other policies
+  keep a single run queue per core, in @c ready_queue[0].
+
+  The hooks that take a core are called with its @c sched_lock held.
+ */
+typedef struct sched_ops {
+	const char* name; /**< @brief The name of the policy */
+
+	/** @brief Initialize the run queues of a core. */
+	void (*init)(CCB* core);
+
+	/** @brief Add a ready thread to the run queues of a core. */
+	void (*enqueue)(CCB* core, TCB* tcb);
+
+	/** @brief Remove and return the next thread to run from a core, or NULL.
+
+	  If @c thief is not NULL, only a thread that may run on core @c thief 
+	  is removed (the thread is being stolen).
+	 */
+	TCB* (*select)(CCB* core, CCB* thief);
+
+	/** @brief Adjust a thread whose time slice ended, after @c ran microseconds. */
+	void (*on_yield)(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran);
+
+	/** @brief Adjust a thread woken from sleep, before it is enqueued to a core. */
+	void (*on_wakeup)(CCB* core, TCB* tcb);
+
+	/** @brief Called at every yield of a core. */
+	void (*tick)(CCB* core);
+
+	/** @brief Priority inheritance: favour @c tcb, which blocks @c waiter.
+
+	  If @c tcb is queued, @c core is its core, else it is NULL. A policy
+	  that changes @c tcb so that it must be undone sets @c tcb->pi_saved.
+	 */
+	void (*inherit)(CCB* core, TCB* tcb, TCB* waiter);
+
+	/** @brief Undo the effects of @c inherit on a thread that is not queued. */
+	void (*restore)(TCB* tcb);
+} sched_ops;
+
+/** @brief The multi-level feedback queue policy (the default). */
+extern const sched_ops sched_mlfq_ops;
+
+/** @brief The round-robin policy. */
+extern const sched_ops sched_rr_ops;
+
+/** @brief The fair-share policy, which runs the thread with the least virtual runtime. */
+extern const sched_ops sched_cfs_ops;
+
+
 /** 
   @brief The current thread.
 
@@ -220,9 +404,131 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The stack size of the new thread. It must be legal for
+                @c thread_stack_size().
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+	@brief Round a requested stack size to a supported size.
+
+	@returns the smallest supported stack size not less than @c size, 
+	   or 0 if @c size is larger than @c THREAD_STACK_MAX.
+ */
+size_t thread_stack_size(size_t size);
+
+/**
+	@brief Return the stack high-water mark of a thread.
+
+	This is the largest number of bytes of the stack that the thread has 
+	used so far. It is measured by looking for the lowest stack location
+	whose canary has been overwritten, and it is 0 if @c THREAD_STACK_CANARY
+	is not defined.
+ */
+size_t thread_stack_used(TCB* tcb);
+
+/**
+	@brief Return the current thread, without turning preemption off.
+
+	This is cheaper than @c cur_thread(), for use in hot paths such as
+	@c Mutex_Lock().
+ */
+TCB* cur_thread_fast();
+
+/**
+	@brief Priority inheritance: raise the holder of a lock to the current thread's priority.
+
+	This is called by a thread that is about to block on a lock. The
+	holder of the lock is the thread stored at @c *owner, if any. If 
+	its priority is lower than the caller's, it inherits the caller's
+	priority (moving up in the run queues, if it is queued), until it 
+	calls @c sched_restore_priority(). What priority means is up to the
+	scheduling policy, see @c sched_ops.
+
+	The holder must not be released while it is stored at @c *owner.
+	Threads that clear @c *owner and then exit are safe, since 
+	@c release_TCB() synchronizes with this call.
+
+	@param owner the location of the holder of the lock
+ */
+void sched_inherit_priority(void** owner);
+
+/**
+	@brief Drop the priority inherited by a thread.
+
+	This is called by a thread that releases its last lock, if @c tcb->pi_saved 
+	shows that it has inherited a priority. Until then, the thread keeps the
+	highest priority lent to it, since waiters of any lock that it still 
+	holds may have lent it.
+ */
+void sched_restore_priority(TCB* tcb);
+
+/**
+	@brief Check whether a thread is running on some core.
+
+	This is used by @c Mutex_Lock() to spin only while the holder of
+	the mutex runs. The thread is not dereferenced, so it may be stale.
+
+	@param tcb the thread, or NULL
+	@returns 1 if @c tcb is the current thread of some core, else 0
+ */
+int sched_thread_running(TCB* tcb);
+
+/**
+	@brief Set the CPU affinity of a thread.
+
+	The new affinity of a queued or running thread takes effect the next time
+	it is scheduled. If @c tcb is the current thread and it may no longer run 
+	on the current core, it yields, so that it moves at once.
+
+	@param tcb the thread, which must not have exited
+	@param set the new affinity, which must contain some core below @c cpu_cores()
+ */
+void sched_set_affinity(TCB* tcb, const coreset_t* set);
+
+/**
+	@brief Reserve a share of the cores for a new real-time thread.
+
+	The reservation is admitted only if the total utilization of the 
+	real-time threads stays within @c RT_UTILIZATION_MAX. It is released
+	by @c sched_set_realtime(tcb, NULL).
+
+	@param params valid real-time parameters
+	@returns 0 on success, or -1 if the reservation was not admitted
+ */
+int sched_rt_admit(const rtparams* params);
+
+/**
+	@brief Make a new thread a real-time thread, or a real-time thread a normal one.
+
+	This is called for a new thread before its first wakeup, with parameters
+	admitted by @c sched_rt_admit(), or by a real-time thread for itself as
+	it exits, with NULL.
+
+	@param tcb the thread
+	@param params the real-time parameters, or NULL to leave the real-time class
+ */
+void sched_set_realtime(TCB* tcb, const rtparams* params);
+
+/**
+	@brief Complete the job of the current period of the current thread.
+
+	The current thread must be a real-time thread. The job is counted,
+	as a deadline miss if it is late.
+
+	@returns the start of the next period, when the current thread should
+	run again, or the current time if the next period has already started.
+ */
+TimerDuration sched_rt_complete(void);
+
+/**
+	@brief Return the scheduler statistics of a core.
+
+	@param core the core, below @c cpu_cores()
+	@param info the location where the statistics are stored
+ */
+void sched_core_info(uint core, schedinfo* info);
 
 /**
   @brief Wakeup a blocked thread.
@@ -240,11 +546,11 @@ int wakeup(TCB* tcb);
   @brief Block the current thread.
 
 	This call will block the current thread, changing its state to @c STOPPED
-	or @c EXITED. Also, the mutex @c mx, if not `NULL`, will be unlocked, atomically
-	with the blocking of the thread. 
+	or @c EXITED. Also, the spinlock @c sl and the mutex @c mx, if not `NULL`, will be 
+	unlocked, atomically with the blocking of the thread. 
 
 	In particular, what is meant by 'atomically' is that the thread state will change
-	to @c newstate atomically with the mutex unlocking. Note that, the state of
+	to @c newstate atomically with the unlocking. Note that, the state of
 	the current thread is @c RUNNING. 
 	Therefore, no other state change (such as a wakeup, a yield, another sleep etc) 
 	can happen "between" the thread's state change and the unlocking.
@@ -262,11 +568,13 @@ int wakeup(TCB* tcb);
 	@c wakeup() by another thread.
 
 	@param newstate the new state for the current thread, which must be either stopped or exited
-	@param mx the mutex to unlock.
+	@param sl the spinlock to unlock, or NULL.
+	@param mx the mutex to unlock, or NULL. It is unlocked after @c sl.
 	@param cause the cause of the sleep
 	@param timeout a timeout for the sleep, or 
    */
-void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
+void sleep_releasing(Thread_state newstate, Spinlock* sl, Mutex* mx, 
+	enum SCHED_CAUSE cause, TimerDuration timeout);
 
 /**
   @brief Give up the CPU.
@@ -290,10 +598,18 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+
+   @param policy the scheduling policy
  */
-void initialize_scheduler(void);
+void initialize_scheduler(sched_policy policy);
 
-void boost_thread(void);
+/**
+  @brief Release the resources of the scheduler.
+
+   This function is called after the scheduler has stopped on all cores.
+   It frees the thread memory kept for reuse.
+ */
+void finalize_scheduler(void);
 
 /**
   @brief Quantum (in microseconds) 
@@ -3,9 +3,13 @@
 #include "kernel_streams.h"
 #include "util.h"
 #include "kernel_socket.h"
+#include "kernel_cc.h"
 
 socket_cb* PORT_MAP[MAX_PORT+1];
 
+/* Protects PORT_MAP. Taken before the lock of a listener. */
+static Mutex port_lock = MUTEX_INIT;
+
 file_ops socket_file_ops = {
 	.Open = NULL,
 	.Read = socket_read,
@@ -42,8 +46,12 @@ int socket_close(void* socketcb_t){
 	}
 	// LISTENER CLOSE
 	if (scb->type == SOCKET_LISTENER){
-		kernel_broadcast(&scb->listener_s.req_available); 	// Wake up socket waiting in listener
+		Mutex_Lock(&port_lock);
 		PORT_MAP[scb->port] = NULL; 						// Release the socket from the port map
+		Mutex_Lock(&scb->lock);
+		Mutex_Unlock(&port_lock);
+		kernel_broadcast(&scb->listener_s.req_available); 	// Wake up socket waiting in listener
+		Mutex_Unlock(&scb->lock);
 	}
 
 	scb = NULL;
@@ -62,12 +70,12 @@ Fid_t sys_Socket(port_t port)
 		return NOFILE;
 
 	socket_cb* scb = (socket_cb*)xmalloc(sizeof(socket_cb));
+	scb->lock = MUTEX_INIT;
 	scb->refcount = 1;
 	scb->fcb = fcb[0]; 
-	fcb[0]->streamobj = scb;
-	fcb[0]->streamfunc = &socket_file_ops;
 	scb->type = SOCKET_UNBOUND;
 	scb->port = port;
+	FCB_publish(fcb[0], scb, &socket_file_ops);
 
 	return fid;
 }
@@ -88,19 +96,24 @@ int sys_Listen(Fid_t sock)
 		return -1;
 	if(scb->port == NOPORT)				// Check if socket is not bound to a port
 		return -1;
-	if(PORT_MAP[scb->port] != NULL)		// Check if port to bound at, is unavailable
+
+	Mutex_Lock(&port_lock);
+	if(PORT_MAP[scb->port] != NULL) {	// Check if port to bound at, is unavailable
+		Mutex_Unlock(&port_lock);
 		return -1;
-	
-	// Install scb to the PORT_MAP
-	PORT_MAP[scb->port] = scb;
-	
-	// Make scb type a LISTENER
-	scb->type = SOCKET_LISTENER;
+	}
 
 	// Initialize listener_socket fields
 	rlnode_init(&scb->listener_s.queue, NULL);
 	scb->listener_s.req_available = COND_INIT;
 
+	// Make scb type a LISTENER
+	scb->type = SOCKET_LISTENER;
+	
+	// Install scb to the PORT_MAP
+	PORT_MAP[scb->port] = scb;
+	Mutex_Unlock(&port_lock);
+
 	return 0;
 }
 
@@ -120,12 +133,15 @@ Fid_t sys_Accept(Fid_t lsock)
 	if(lscb->type != SOCKET_LISTENER)			// Socket is not type listener 
 		return NOFILE;
 
+	Mutex_Lock(&lscb->lock);
 	lscb->refcount = lscb->refcount + 1;		// Increase refcount
 
 	while(is_rlist_empty(&(lscb->listener_s.queue))){				// If list of requests in the listener queue is empty 
-		kernel_wait(&lscb->listener_s.req_available, SCHED_IO);		// kernel wait until we receive a request
-		if(PORT_MAP[lscb->port] == NULL)							// While waiting, if the listening socket port closes, 
+		kernel_wait(&lscb->lock, &lscb->listener_s.req_available, SCHED_IO);		// kernel wait until we receive a request
+		if(PORT_MAP[lscb->port] != lscb) {							// While waiting, if the listening socket port closes, 
+			Mutex_Unlock(&lscb->lock);
 			return NOFILE;											// return error.
+		}
 	}
 
 	rlnode* found = rlist_pop_front(&lscb->listener_s.queue);		// pop front in the queue the incoming node
@@ -142,14 +158,14 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	int reserved3 = FCB_reserve(1, &fid3, fcb3);
 	if(reserved3 == 0){
+		Mutex_Unlock(&lscb->lock);
 		return NOFILE;
 	}
 	
 	socket_cb* socket_cb3 = (socket_cb*)xmalloc(sizeof(socket_cb));
+	socket_cb3->lock = MUTEX_INIT;
 	socket_cb3->refcount = 1;
 	socket_cb3->fcb = fcb3[0]; 
-	fcb3[0]->streamobj = socket_cb3;
-	fcb3[0]->streamfunc = &socket_file_ops;
 	socket_cb3->type = SOCKET_UNBOUND;
 	//socket_cb3->port = port;
 
@@ -162,12 +178,10 @@ Fid_t sys_Accept(Fid_t lsock)
 	pipe_cb* pipe_cb1 = (pipe_cb*)xmalloc(sizeof(pipe_cb));
 	pipe_cb* pipe_cb2 = (pipe_cb*)xmalloc(sizeof(pipe_cb));
 
-	// PIPE_CB1
-	pipe_cb1->reader->streamobj = socket_cb2; 
-	pipe_cb1->writer->streamobj = socket_cb3;
-
-	pipe_cb1->reader->streamfunc = &socket_file_ops;
-	pipe_cb1->writer->streamfunc = &socket_file_ops;
+	// PIPE_CB1, the ends are the streams of the two sockets
+	pipe_cb1->lock = MUTEX_INIT;
+	pipe_cb1->reader = socket_cb2->fcb;
+	pipe_cb1->writer = socket_cb3->fcb;
 
 	pipe_cb1->r_position = 0;
 	pipe_cb1->w_position = 0;
@@ -176,11 +190,9 @@ Fid_t sys_Accept(Fid_t lsock)
 	pipe_cb1->has_space = COND_INIT;
 
 	// PIPE_CB2
-	pipe_cb2->reader->streamobj = socket_cb3;
-	pipe_cb2->writer->streamobj = socket_cb2;
-
-	pipe_cb2->reader->streamfunc = &socket_file_ops;
-	pipe_cb2->writer->streamfunc = &socket_file_ops;
+	pipe_cb2->lock = MUTEX_INIT;
+	pipe_cb2->reader = socket_cb3->fcb;
+	pipe_cb2->writer = socket_cb2->fcb;
 
 	pipe_cb2->r_position = 0;
 	pipe_cb2->w_position = 0;
@@ -195,6 +207,9 @@ Fid_t sys_Accept(Fid_t lsock)
 	socket_cb3->peer_s.read_pipe = pipe_cb2;
 	socket_cb3->peer_s.write_pipe = pipe_cb1;
 
+	// The server socket is complete, other threads may use it now
+	FCB_publish(fcb3[0], socket_cb3, &socket_file_ops);
+
 	// Change admitted to 1
 	req->admitted = 1;
 
@@ -203,6 +218,7 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	// Decrease refcount
 	lscb->refcount = lscb->refcount - 1;
+	Mutex_Unlock(&lscb->lock);
 
 	return fid3;
 }
@@ -210,7 +226,7 @@ Fid_t sys_Accept(Fid_t lsock)
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	if(PORT_MAP[port] == NULL || PORT_MAP[port]->type != SOCKET_LISTENER)	// Socket is unconnected or non-listening
+	if(port <= NOPORT || port > MAX_PORT)
 		return -1;
 
 	FCB* fcb = get_fcb(sock);
@@ -223,6 +239,16 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	if(scb->type != SOCKET_UNBOUND)		// Must be unbounded 
 		return -1;
 
+	// Find the listener, and lock it before it can be closed
+	Mutex_Lock(&port_lock);
+	socket_cb* lscb = PORT_MAP[port];
+	if(lscb == NULL || lscb->type != SOCKET_LISTENER) {	// Socket is unconnected or non-listening
+		Mutex_Unlock(&port_lock);
+		return -1;
+	}
+	Mutex_Lock(&lscb->lock);
+	Mutex_Unlock(&port_lock);
+
 	scb->refcount = scb->refcount + 1;
 
 	// Building the request
@@ -235,12 +261,12 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	req->peer->type = SOCKET_PEER;
 
 	// Adding request to listener's request queue and kernel_signal listener
-	socket_cb* lscb = PORT_MAP[port];
 	rlist_push_back(&lscb->listener_s.queue, &req->queue_node);
 	kernel_broadcast(&lscb->listener_s.req_available);
 
 	//while(req->admitted == 0){
-		int timeout_error = kernel_timedwait(&req->connect_cv, SCHED_PIPE, 1000);
+		int timeout_error = kernel_timedwait(&lscb->lock, &req->connect_cv, SCHED_PIPE, 1000);
+		Mutex_Unlock(&lscb->lock);
 		if(!timeout_error)
 			return -1;
 	//}
@@ -33,6 +33,7 @@ typedef struct peer {
 } peer_socket;
 
 typedef struct socket_control_block {
+	Mutex lock;		// Protects a listener's request queue; Accept and Connect wait releasing it
 	uint refcount;
 	FCB* fcb;
 	socket_type type;
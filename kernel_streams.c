@@ -11,6 +11,9 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* Protects FCB_freelist. The FIDT of each process has its own lock. */
+static Mutex file_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -26,32 +29,37 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+  Mutex_Lock(&file_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
+    /* The stream is not open until its operations are set */
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
   }
-  else
-    return NULL;
+  Mutex_Unlock(&file_lock);
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(&file_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(&file_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -67,6 +75,9 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     PCB* cur = CURPROC;
     size_t f=0;
     uint i;
+    int ok = 0;
+
+    Mutex_Lock(&cur->fidt_lock);
 
     /* Find distinct fids */
     for(i=0; i<num; i++) {
@@ -75,7 +86,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto finish;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +97,18 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto finish;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
-    return 1;
+    ok = 1;
+
+finish:
+    Mutex_Unlock(&cur->fidt_lock);
+    return ok;
 }
 
 
@@ -101,11 +116,54 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->fidt_lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->fidt_lock);
+}
+
+
+void FCB_publish(FCB* fcb, void* obj, file_ops* ops)
+{
+  fcb->streamobj = obj;
+  /* Pairs with the acquire in lookup_fcb() */
+  __atomic_store_n(&fcb->streamfunc, ops, __ATOMIC_RELEASE);
+}
+
+
+static inline FCB* lookup_fcb(PCB* cur, Fid_t fid);
+
+void FCB_inherit(PCB* pcb, PCB* parent)
+{
+  Mutex_Lock(&parent->fidt_lock);
+  for(int i=0; i<MAX_FILEID; i++) {
+    /* A stream that another thread is still opening is not inherited */
+    pcb->FIDT[i] = lookup_fcb(parent, i);
+    if(pcb->FIDT[i])
+      FCB_incref(pcb->FIDT[i]);
+  }
+  Mutex_Unlock(&parent->fidt_lock);
+}
+
+
+void FCB_close_all(PCB* pcb)
+{
+  FCB* fcbs[MAX_FILEID];
+
+  /* Empty the FIDT, then close the streams without holding its lock */
+  Mutex_Lock(&pcb->fidt_lock);
+  for(int i=0;i<MAX_FILEID;i++) {
+    fcbs[i] = pcb->FIDT[i];
+    pcb->FIDT[i] = NULL;
+  }
+  Mutex_Unlock(&pcb->fidt_lock);
+
+  for(int i=0;i<MAX_FILEID;i++)
+    if(fcbs[i] != NULL)
+      FCB_decref(fcbs[i]);
 }
 
 
@@ -120,41 +178,57 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
  */
 
 
-FCB* get_fcb(Fid_t fid)
+/* Return the open stream of fid, called with the FIDT lock held */
+static inline FCB* lookup_fcb(PCB* cur, Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  /* A stream that is still being opened has no operations yet (see FCB_publish()) */
+  FCB* fcb = cur->FIDT[fid];
+  return (fcb && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE)) ? fcb : NULL;
+}
+
+
+FCB* get_fcb(Fid_t fid)
+{
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* fcb = lookup_fcb(cur, fid);
+  Mutex_Unlock(&cur->fidt_lock);
+  return fcb;
+}
+
+
+FCB* get_fcb_ref(Fid_t fid)
+{
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* fcb = lookup_fcb(cur, fid);
+  if(fcb) FCB_incref(fcb);
+  Mutex_Unlock(&cur->fidt_lock);
+  return fcb;
 }
 
 
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* 
+    Get the stream, making sure that it will not be closed (by another thread) 
+    while we are using it! 
+  */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
+    int (*devread)(void*,char*,uint) = fcb->streamfunc->Read;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
     if(devread)
-      retcode = devread(sobj, buf, size);
+      retcode = devread(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -163,32 +237,23 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* 
+    Get the stream, making sure that it will not be closed (by another thread) 
+    while we are using it! 
+  */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
+    int (*devwrite)(void*, const char*, uint) = fcb->streamfunc->Write;
 
     if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+      retcode = devwrite(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
-
   }
 
-
   return retcode;
 }
 
@@ -197,12 +262,15 @@ int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
-  FCB* fcb = get_fcb(fd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* fcb = lookup_fcb(cur, fd);
+  if(fcb)
+    cur->FIDT[fd] = NULL;
+  Mutex_Unlock(&cur->fidt_lock);
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -214,6 +282,7 @@ int sys_Close(int fd)
   This call returns 0 on success and -1 on failure.
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
+  - newfd is reserved by a stream that another thread is still opening.
  */
 int sys_Dup2(int oldfd, int newfd)
 {
@@ -221,18 +290,29 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+
+  FCB* old = lookup_fcb(cur, oldfd);
+  FCB* new = cur->FIDT[newfd];
 
-  if(old==NULL) {
+  /* The opener of a reserved FCB will publish or unreserve it at newfd */
+  if(old==NULL || (new!=NULL && lookup_fcb(cur, newfd)==NULL)) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  else
+    new = NULL;
+
+  Mutex_Unlock(&cur->fidt_lock);
+
+  /* The stream replaced at newfd is released without the lock */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -252,15 +332,18 @@ Fid_t open_stream(Device_type major, unsigned int minor)
 {
   Fid_t fid;
   FCB* fcb;
+  void* obj;
+  file_ops* ops;
 
 
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  if(device_open(major, minor, &obj, &ops)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_publish(fcb, obj, ops);
   
   goto finok;
 finerr:
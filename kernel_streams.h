@@ -23,6 +23,12 @@
 	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
 	and @ref FCB_unreserve.
 
+	The file table of each process is protected by the process' 
+	@c fidt_lock, and the free FCBs by a lock of this module, 
+	so system calls on the streams of different processes, or on 
+	different streams, do not serialize. The reference count of an 
+	FCB is updated atomically.
+
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
 	for read, write and close.
@@ -118,9 +124,51 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Open a reserved stream.
+
+   Set the stream object and the operations of an FCB returned by 
+   @ref FCB_reserve. This must be called after the stream object is 
+   fully initialized: until then, the other threads of the process 
+   see the file id as closed, and once it is called they may use the
+   stream at once.
+
+   @param fcb the reserved FCB.
+   @param obj the stream object.
+   @param ops the stream operations.
+*/
+void FCB_publish(FCB* fcb, void* obj, file_ops* ops);
+
+
+/** @brief Copy the file ids of a process to a new process.
+
+	Each stream of @c parent is shared with @c pcb, under the same
+	file id, and its reference count is increased.
+
+	@param pcb the new process, whose FIDT is overwritten
+	@param parent the process whose FIDT is copied
+ */
+void FCB_inherit(PCB* pcb, PCB* parent);
+
+
+/** @brief Close all the file ids of a process.
+
+	The FIDT of the process is emptied and the reference count of each
+	stream is decreased, closing the streams that are no longer used.
+
+	@param pcb the process
+ */
+void FCB_close_all(PCB* pcb);
+
+
 /** @brief Translate an fid to an FCB.
 
-	This routine will return NULL if the fid is not legal.
+	This routine will return NULL if the fid is not legal, or
+	if its stream is still being opened (the stream operations
+	of an FCB are set last, when the stream is ready).
+
+	Note that the FCB may be closed by another thread of the 
+	process, if the caller does not hold a reference; see
+	@ref get_fcb_ref.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -128,6 +176,18 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB and take a reference to it.
+
+	This is like @ref get_fcb, but the reference count of the FCB
+	is increased, so that the stream stays open while it is used.
+	The reference must be released by @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
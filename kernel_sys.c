@@ -9,36 +9,24 @@
 
 /*
 	Define all the syscalls 
- */
-
-
-#define PRE_CALL \
-kernel_lock();\
 
-
-
-#define POST_CALL \
-kernel_unlock();\
+	There is no kernel lock to take here: each system call takes the 
+	locks of the kernel objects it uses.
+ */
 
 
 /* with return */
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET NAME SIG \
 {\
-	RET __ret;\
-	PRE_CALL\
-	__ret = sys_##NAME ARGS;\
-	POST_CALL\
-	return __ret;\
+	return sys_##NAME ARGS;\
 }\
 
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
 {\
-	PRE_CALL\
 	sys_##NAME ARGS;\
-	POST_CALL\
 }\
 
 
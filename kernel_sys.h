@@ -11,10 +11,16 @@ SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateRealtimeThread, Tid_t, (Task task, int argl, void* args, const rtparams* params), (task, argl, args, params))\
+SYSCALL(ThreadWaitPeriod, int, (void), ())\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetStackSize, int, (unsigned int size), (size))\
+SYSCALL(ThreadInfo, int, (Tid_t tid, threadinfo* info), (tid, info))\
+SYSCALL(ThreadSetAffinity, int, (Tid_t tid, const coreset_t* set), (tid, set))\
+SYSCALL(ThreadGetAffinity, int, (Tid_t tid, coreset_t* set), (tid, set))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -29,6 +35,7 @@ SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenSchedInfo, Fid_t, (), ())\
 
 
 
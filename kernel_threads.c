@@ -20,16 +20,10 @@ void start_process_thread(){
   sys_ThreadExit(exitval);
 }
 
-/** 
-  @brief Create a new thread in the current process.
-  */
-Tid_t sys_CreateThread(Task task, int argl, void* args)
+/* Create a new thread in the current process, without waking it up. 
+   Must be called with proc_lock held. */
+static PTCB* new_process_thread(Task task, int argl, void* args)
 {
-   // PCB* curproc_pcb = CURPROC;
-   // TCB* tcb = spawn_thread(CURPROC, start_process_thread);  // Initialize and return a new TCB
-   // CURPROC -> thread_count++;                                    // Increase by 1 the thread counter
-   // Initialize arguments, like I did in sys_Exec
-  if(task != NULL){
 
       // PTCB STUFF
       PTCB* ptcb = (PTCB* )xmalloc(sizeof(PTCB));   // Memory allocation for a PTCB block 
@@ -43,9 +37,12 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
       ptcb->exit_cv = COND_INIT;
       ptcb->refcount = 1;
 
-      // TCB STUFF
-      TCB* new_tcb = spawn_thread(CURPROC, start_process_thread);  // Initialize and return a new TCB
       PCB* curproc = CURPROC;
+      ptcb->stack_size = curproc->stack_size;
+      ptcb->stack_used = 0;
+
+      // TCB STUFF
+      TCB* new_tcb = spawn_thread(curproc, start_process_thread, ptcb->stack_size);  // Initialize and return a new TCB
       curproc->thread_count ++;
       
       // Connections through PTCB, TCB
@@ -56,12 +53,68 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
       rlnode_init(&(ptcb->ptcb_list_node), ptcb);                     //Initializing the rlnode in PTCB
       rlist_push_back(&(curproc->ptcb_list), &(ptcb->ptcb_list_node));  //Pushing back on the list the current PTCB element 
     
-      wakeup(new_tcb);
+      return ptcb;
+}
+
+/** 
+  @brief Create a new thread in the current process.
+  */
+Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+   // PCB* curproc_pcb = CURPROC;
+   // TCB* tcb = spawn_thread(CURPROC, start_process_thread);  // Initialize and return a new TCB
+   // CURPROC -> thread_count++;                                    // Increase by 1 the thread counter
+   // Initialize arguments, like I did in sys_Exec
+  if(task != NULL){
+      Mutex_Lock(&proc_lock);
+      PTCB* ptcb = new_process_thread(task, argl, args);
+      wakeup(ptcb->tcb);
+      Mutex_Unlock(&proc_lock);
       return (Tid_t)ptcb;
     }
     return -1;
 }
 
+/** 
+  @brief Create a new real-time thread in the current process.
+  */
+Tid_t sys_CreateRealtimeThread(Task task, int argl, void* args, const rtparams* params)
+{
+  if(task == NULL || params == NULL)
+    return NOTHREAD;
+  if(params->budget == 0 || params->budget > params->deadline || params->deadline > params->period)
+    return NOTHREAD;
+
+  if(sched_rt_admit(params) != 0)
+    return NOTHREAD;
+
+  Mutex_Lock(&proc_lock);
+  PTCB* ptcb = new_process_thread(task, argl, args);
+  sched_set_realtime(ptcb->tcb, params);
+  wakeup(ptcb->tcb);
+  Mutex_Unlock(&proc_lock);
+  return (Tid_t)ptcb;
+}
+
+/**
+  @brief Complete the job of the current period of a real-time thread.
+  */
+int sys_ThreadWaitPeriod()
+{
+  if(! cur_thread()->rt.active)
+    return -1;
+
+  TimerDuration release = sched_rt_complete();
+  Mutex mx = MUTEX_INIT;
+  CondVar period = COND_INIT;
+  TimerDuration now;
+  Mutex_Lock(&mx);
+  while((now = bios_clock()) < release)
+    kernel_timedwait(&mx, &period, SCHED_USER, release - now);
+  Mutex_Unlock(&mx);
+  return 0;
+}
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -70,10 +123,8 @@ Tid_t sys_ThreadSelf()
 	return (Tid_t) (cur_thread()->ptcb);   // easy
 }
 
-/**
-  @brief Join the given thread.
-  */
-int sys_ThreadJoin(Tid_t tid, int* exitval)
+/* Join the given thread, called with proc_lock held */
+static int thread_join(Tid_t tid, int* exitval)
 {
   // Locate locally a ptcb
   PTCB* ptcb = (PTCB* ) tid;
@@ -112,13 +163,18 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     while(ptcb->detached == 0  && ptcb->exited == 0){
       //if(ptcb->tcb->owner_pcb->parent->exitval == 1)
       // return 0;
-      kernel_wait(&(ptcb->exit_cv), SCHED_USER);      // kernel_wait puts to temporary sleep incoming threads, waiting for the condvar of current thread to become detached or exited
+      kernel_wait(&proc_lock, &(ptcb->exit_cv), SCHED_USER);      // kernel_wait puts to temporary sleep incoming threads, waiting for the condvar of current thread to become detached or exited
       // Saving the exit value...
       // exitval = &(ptcb->exitval);
     }
 
     ptcb->refcount = ptcb->refcount - 1; // ptcb has left the chat
 
+    // Thread was detached while we were waiting, the join fails
+    if(ptcb->detached == 1){
+      return -1;
+    }
+
     if(exitval!=NULL){
       *exitval = ptcb->exitval;
     }
@@ -132,9 +188,19 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 }
 
 /**
-  @brief Detach the given thread.
+  @brief Join the given thread.
   */
-int sys_ThreadDetach(Tid_t tid)
+int sys_ThreadJoin(Tid_t tid, int* exitval)
+{
+  Mutex_Lock(&proc_lock);
+  int ret = thread_join(tid, exitval);
+  Mutex_Unlock(&proc_lock);
+  return ret;
+}
+
+
+/* Detach the given thread, called with proc_lock held */
+static int thread_detach(Tid_t tid)
 {
   
   // Finding the thread to join, connecting it with ptcb
@@ -162,6 +228,128 @@ return -1;
 
 }
 
+/**
+  @brief Detach the given thread.
+  */
+int sys_ThreadDetach(Tid_t tid)
+{
+  Mutex_Lock(&proc_lock);
+  int ret = thread_detach(tid);
+  Mutex_Unlock(&proc_lock);
+  return ret;
+}
+
+_Static_assert(STACK_SIZE_MIN == THREAD_STACK_MIN && STACK_SIZE_MAX == THREAD_STACK_MAX,
+  "The stack size limits of tinyos.h and kernel_sched.h disagree");
+
+/**
+  @brief Set the stack size of new threads of the current process.
+  */
+int sys_SetStackSize(unsigned int size)
+{
+  PCB* curproc = CURPROC;
+  int prev = curproc->stack_size;
+
+  if(size == 0)
+    return prev;
+
+  size_t ssize = thread_stack_size(size);
+  if(ssize == 0)
+    return -1;
+
+  /* Exec and CreateThread read the stack size under the lock */
+  Mutex_Lock(&proc_lock);
+  prev = curproc->stack_size;
+  curproc->stack_size = ssize;
+  Mutex_Unlock(&proc_lock);
+  return prev;
+}
+
+/**
+  @brief Return information about a thread of the current process.
+  */
+int sys_ThreadInfo(Tid_t tid, threadinfo* info)
+{
+  PTCB* ptcb = (PTCB*) tid;
+  if(info == NULL)
+    return -1;
+
+  Mutex_Lock(&proc_lock);
+  if(!rlist_find(&CURPROC->ptcb_list, ptcb, NULL)) {
+    Mutex_Unlock(&proc_lock);
+    return -1;
+  }
+
+  info->tid = tid;
+  info->exited = ptcb->exited;
+  info->stack_size = ptcb->stack_size;
+  info->stack_used = ptcb->exited ? ptcb->stack_used : thread_stack_used(ptcb->tcb);
+
+  sched_stats* stats = ptcb->exited ? &ptcb->stats : &ptcb->tcb->stats;
+  info->runtime = stats->runtime;
+  info->wait_time = stats->wait_time;
+  info->voluntary_switches = stats->voluntary;
+  info->involuntary_switches = stats->involuntary;
+  info->jobs = stats->rt_jobs;
+  info->deadline_misses = stats->rt_misses;
+  info->throttles = stats->rt_throttles;
+  for(int i=0; i<THREADINFO_LEVELS; i++)
+    info->level_time[i] = stats->level_time[i];
+  Mutex_Unlock(&proc_lock);
+  return 0;
+}
+
+_Static_assert(CORESET_SIZE >= MAX_CORES, "A coreset_t cannot hold all the cores");
+
+/* Return the live thread with the given tid in the current process, or NULL. 
+   Must be called with proc_lock held. */
+static PTCB* find_live_thread(Tid_t tid)
+{
+  PTCB* ptcb = (PTCB*) tid;
+  if(!rlist_find(&CURPROC->ptcb_list, ptcb, NULL) || ptcb->exited)
+    return NULL;
+  return ptcb;
+}
+
+/**
+  @brief Set the CPU affinity of a thread.
+  */
+int sys_ThreadSetAffinity(Tid_t tid, const coreset_t* set)
+{
+  if(set == NULL)
+    return -1;
+
+  /* Some existing core must be in the set */
+  uint c;
+  for(c = 0; c < cpu_cores(); c++)
+    if(CORESET_ISSET(c, set)) break;
+  if(c == cpu_cores())
+    return -1;
+
+  Mutex_Lock(&proc_lock);
+  PTCB* ptcb = find_live_thread(tid);
+  if(ptcb != NULL)
+    sched_set_affinity(ptcb->tcb, set);
+  Mutex_Unlock(&proc_lock);
+  return (ptcb != NULL) ? 0 : -1;
+}
+
+/**
+  @brief Get the CPU affinity of a thread.
+  */
+int sys_ThreadGetAffinity(Tid_t tid, coreset_t* set)
+{
+  if(set == NULL)
+    return -1;
+
+  Mutex_Lock(&proc_lock);
+  PTCB* ptcb = find_live_thread(tid);
+  if(ptcb != NULL)
+    *set = ptcb->tcb->affinity;
+  Mutex_Unlock(&proc_lock);
+  return (ptcb != NULL) ? 0 : -1;
+}
+
 /**
   @brief Terminate the current thread.
   */
@@ -170,10 +358,16 @@ void sys_ThreadExit(int exitval)
 
 PTCB* ptcb = (cur_thread()->ptcb);
 
+Mutex_Lock(&proc_lock);
+
 // Brute exit now if someone remains...
 //if(ptcb!=NULL){
   ptcb->exited = 1;
   ptcb->exitval = exitval;
+  ptcb->stack_used = thread_stack_used(cur_thread());
+  ptcb->stats = cur_thread()->stats;
+  if(cur_thread()->rt.active)
+    sched_set_realtime(cur_thread(), NULL);
 
   PCB* curproc = CURPROC;
   
@@ -226,12 +420,7 @@ PTCB* ptcb = (cur_thread()->ptcb);
     }
 
     /* Clean up FIDT */
-    for(int i=0;i<MAX_FILEID;i++) {
-      if(curproc->FIDT[i] != NULL) {
-        FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
-      }
-    }
+    FCB_close_all(curproc);
 
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
@@ -243,7 +432,7 @@ PTCB* ptcb = (cur_thread()->ptcb);
 
   
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  kernel_sleep(&proc_lock, EXITED, SCHED_USER);
 
 }
 
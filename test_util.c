@@ -268,6 +268,35 @@ TEST_SUITE(rlist_tests,
 
 
 
+BARE_TEST(test_bitmap,
+	"Test setting, searching and shifting multi-word bitmaps"
+	)
+{
+	uint64_t bm[BITMAP_WORDS(130)] = { 0 };
+	ASSERT(BITMAP_WORDS(130)==3);
+	ASSERT(bitmap_find_first(bm, 3)==-1);
+	ASSERT(bitmap_find_last(bm, 3)==-1);
+
+	bitmap_set(bm, 5);
+	bitmap_set(bm, 63);
+	bitmap_set(bm, 64);
+	bitmap_set(bm, 129);
+	ASSERT(bitmap_test(bm, 63) && bitmap_test(bm, 64) && !bitmap_test(bm, 65));
+	ASSERT(bitmap_find_first(bm, 3)==5);
+	ASSERT(bitmap_find_last(bm, 3)==129);
+
+	bitmap_clear(bm, 129);
+	bitmap_clear(bm, 5);
+	ASSERT(bitmap_find_first(bm, 3)==63);
+	ASSERT(bitmap_find_last(bm, 3)==64);
+
+	bitmap_shl1(bm, 3);
+	ASSERT(bitmap_find_first(bm, 3)==64);
+	ASSERT(bitmap_find_last(bm, 3)==65);
+	ASSERT(!bitmap_test(bm, 63));
+}
+
+
 void test_argv(size_t argc, const char* argv[])
 {
 	int l = argvlen(argc, argv);
@@ -321,6 +350,7 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&test_bitmap,
 	&test_pack_unpack,
 	NULL
 };
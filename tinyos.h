@@ -72,11 +72,20 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A thread that blocks on a mutex lends its priority to the thread
+    holding it (priority inheritance), until the holder unlocks it.
+    In the preemptive domain, a blocked thread is parked on the wait queue
+    of the mutex, and the holder wakes it up on unlock.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+  char lock;        /**< @brief Non-zero while the mutex is locked */
+  void* owner;      /**< @brief The thread holding the mutex, used for priority inheritance */
+  void* waiters;    /**< @brief The threads parked on the mutex */
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,13 +95,14 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, NULL, NULL })
 
 
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking spins while the holder is running
+  on another core, and else parks the thread until the holder unlocks the mutex.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -103,13 +113,36 @@ void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. If threads are parked on the mutex,
+    the one that has waited the longest is woken up. If it has already lost
+    the mutex to a running thread once, the mutex stays locked and passes 
+    to it directly.
     @see Mutex
     @see Mutex_Lock
 */
 void Mutex_Unlock(Mutex*);
 
 
+/** @brief A queued spinlock, used by the kernel in its non-preemptive domain.
+
+  Each core that waits for the lock spins on a queue node of its own, and
+  the holder passes the lock to the next core in the queue on unlock, so that
+  the waiting cores do not contend for a single cache line. When the VM has
+  more cores than the host processors that it may use, it is a test-and-set
+  lock. The operations are kernel-only (see kernel_cc.h); the type appears
+  here because every condition variable contains one.
+
+  @see SPINLOCK_INIT
+ */
+typedef struct {
+  void* tail;       /**< @brief The last node in the queue, NULL if unlocked */
+  void* holder;     /**< @brief The node of the core holding the lock */
+} Spinlock;
+
+/** @brief This macro is used to initialize spinlocks. */
+#define SPINLOCK_INIT ((Spinlock){ NULL, NULL })
+
+
 /** @brief Condition variables.
 
   A condition variable is used for longer synchronization. This implementation
@@ -122,7 +155,7 @@ void Mutex_Unlock(Mutex*);
  */
 typedef struct {
   void *waitset;        /**< The set of waiting threads */
-  Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  Spinlock waitset_lock;   /**< A spinlock to protect `waitset` */
 } CondVar;
 
 
@@ -133,7 +166,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, SPINLOCK_INIT })
 
 
 /** @brief Wait on a condition variable. 
@@ -375,6 +408,203 @@ int ThreadDetach(Tid_t tid);
 void ThreadExit(int exitval);
 
 
+/** @brief The number of cores that a @c coreset_t can hold. */
+#define CORESET_SIZE 256
+
+/**
+  @brief A set of cores.
+
+  This is a bitmap with one bit per core, manipulated by the @c CORESET_... macros.
+  @see ThreadSetAffinity
+ */
+typedef struct core_set
+{
+  uint64_t bits[CORESET_SIZE/64];  /**< @brief Bit @c c%64 of word @c c/64 is set if core @c c is in the set */
+} coreset_t;
+
+/** @brief Make @c set empty. */
+#define CORESET_ZERO(set) do { for(int __w=0; __w<CORESET_SIZE/64; __w++) (set)->bits[__w] = 0; } while(0)
+
+/** @brief Make @c set contain every core. */
+#define CORESET_FILL(set) do { for(int __w=0; __w<CORESET_SIZE/64; __w++) (set)->bits[__w] = ~(uint64_t)0; } while(0)
+
+/** @brief Add core @c c to @c set. */
+#define CORESET_SET(c, set) ((set)->bits[(c)/64] |= (uint64_t)1 << ((c)%64))
+
+/** @brief Remove core @c c from @c set. */
+#define CORESET_CLR(c, set) ((set)->bits[(c)/64] &= ~((uint64_t)1 << ((c)%64)))
+
+/** @brief Non-zero if core @c c is in @c set. */
+#define CORESET_ISSET(c, set) (((set)->bits[(c)/64] >> ((c)%64)) & 1)
+
+/**
+  @brief Set the CPU affinity of a thread.
+
+  The thread will only run on the cores in @c set. A thread that is 
+  running or queued on some other core moves the next time it is 
+  scheduled; a thread that changes its own affinity moves at once.
+  Cores beyond the number of cores of the machine are ignored, but
+  the set must contain at least one existing core.
+
+  Threads inherit the affinity of the thread that created them (also
+  across @c Exec). Initially, a thread may run on any core. 
+
+  Regardless of the affinity, the scheduler prefers to run a thread on
+  the core it last ran on, to keep its caches warm.
+
+  @param tid the thread, which must belong to the current process and not have exited.
+  @param set the new affinity
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no live thread with the given tid in this process.
+    - @c set is NULL, or it contains no existing core.
+  */
+int ThreadSetAffinity(Tid_t tid, const coreset_t* set);
+
+/**
+  @brief Get the CPU affinity of a thread.
+
+  @param tid the thread, which must belong to the current process and not have exited.
+  @param set the location where the affinity is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no live thread with the given tid in this process.
+    - @c set is NULL.
+  @see ThreadSetAffinity
+  */
+int ThreadGetAffinity(Tid_t tid, coreset_t* set);
+
+
+/** @brief The smallest stack size accepted by @c SetStackSize */
+#define STACK_SIZE_MIN (16*1024)
+
+/** @brief The largest stack size accepted by @c SetStackSize */
+#define STACK_SIZE_MAX (2*1024*1024)
+
+/**
+  @brief Set the stack size of new threads.
+
+  This call sets the stack size of the threads created by the current process
+  from now on, by @c CreateThread, and of the main thread of any child processes
+  created by @c Exec. Children inherit this setting. Initially, the stack size
+  is 128 kbytes.
+
+  The size is rounded up to a power of 2, and it must be at most 
+  @c STACK_SIZE_MAX. Sizes below @c STACK_SIZE_MIN are rounded up to it.
+
+  @param size the new stack size in bytes, or 0 to just query the current one
+  @returns the previous stack size, or -1 if @c size is too large.
+  */
+int SetStackSize(unsigned int size);
+
+/** @brief The number of scheduler priority levels reported by @c ThreadInfo. */
+#define THREADINFO_LEVELS 80
+
+/**
+  @brief Information about a thread.
+
+  Times are in microseconds. For an exited thread, they are the values at exit.
+
+  @see ThreadInfo
+ */
+typedef struct thread_info
+{
+  Tid_t tid;                 /**< @brief The tid of the thread */
+  int exited;                /**< @brief Non-zero if the thread has exited */
+  unsigned long stack_size;  /**< @brief The size of the thread's stack, in bytes */
+  unsigned long stack_used;  /**< @brief The deepest point reached by the thread's stack, in bytes.
+
+    For an exited thread, this is the value at exit. The measurement is
+    by a canary pattern filled into the stack, and it is not available (always 0)
+    unless the kernel is compiled with @c THREAD_STACK_CANARY. */
+
+  unsigned long runtime;     /**< @brief Time the thread has spent running */
+  unsigned long wait_time;   /**< @brief Time the thread has spent ready to run, waiting for a core */
+  unsigned long voluntary_switches;    /**< @brief Times the thread gave up its core by blocking or yielding */
+  unsigned long involuntary_switches;  /**< @brief Times the thread was preempted, at the end of its quantum or by a real-time thread */
+  unsigned long jobs;        /**< @brief Periods whose work a real-time thread has completed, see @c ThreadWaitPeriod */
+  unsigned long deadline_misses;  /**< @brief Periods in which a real-time thread missed its deadline */
+  unsigned long throttles;   /**< @brief Times a real-time thread was stopped for using up its budget */
+  unsigned long level_time[THREADINFO_LEVELS];  /**< @brief Running time at each priority level, 
+    from the lowest (0) to the highest. */
+} threadinfo;
+
+/**
+  @brief Return information about a thread.
+
+  The thread must belong to the current process and it must not have been 
+  joined (or, if detached, cleaned up).
+
+  @param tid the thread
+  @param info the location where the information is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c info is NULL.
+  */
+int ThreadInfo(Tid_t tid, threadinfo* info);
+
+/**
+  @brief Real-time parameters of a thread.
+
+  All times are in microseconds, and they must satisfy 
+  @c 0 < budget <= deadline <= period.
+
+  @see CreateRealtimeThread
+ */
+typedef struct thread_rtparams
+{
+  unsigned long period;    /**< @brief The period of the thread */
+  unsigned long budget;    /**< @brief The running time the thread may use in each period */
+  unsigned long deadline;  /**< @brief The deadline of the work of each period, from the start of the period */
+} rtparams;
+
+/** @brief The percentage of the cores that real-time threads may reserve in total. */
+#define RT_UTILIZATION_MAX 90
+
+/**
+  @brief Create a new real-time thread in the current process.
+
+  A real-time thread runs periodically. In every period it is given a
+  budget of running time, which must suffice for the work of the period
+  (its job) to complete before the deadline. The thread signals that its 
+  job has completed by calling @c ThreadWaitPeriod().
+
+  Ready real-time threads are scheduled earliest-deadline-first, ahead of 
+  all other threads, and they preempt other threads when they wake up. A
+  real-time thread that uses up its budget is throttled: it is stopped 
+  until the start of its next period, when the budget is renewed. 
+
+  A job that has not completed by its deadline (while the thread was 
+  running, ready or blocked) counts as a deadline miss, reported by
+  @c ThreadInfo. The guarantee holds only if the threads are admitted:
+  the sum of @c budget/deadline over all real-time threads may not 
+  exceed @c RT_UTILIZATION_MAX percent of the cores.
+
+  The first period starts when the thread is created. Otherwise, a
+  real-time thread is like one created by @c CreateThread.
+
+  @param task the function executed by the thread
+  @param argl the length of the argument
+  @param args the argument
+  @param params the real-time parameters
+  @returns the tid of the new thread, or @c NOTHREAD on error. Possible errors are:
+    - @c task or @c params is NULL.
+    - the parameters are not valid.
+    - admitting the thread would exceed @c RT_UTILIZATION_MAX.
+  */
+Tid_t CreateRealtimeThread(Task task, int argl, void* args, const rtparams* params);
+
+/**
+  @brief Complete the job of the current period of a real-time thread.
+
+  The calling thread sleeps until the start of its next period. If the 
+  job has overrun its period, the call returns at once and the next job
+  starts now.
+
+  @returns 0 on success, or -1 if the current thread is not a real-time thread.
+  @see CreateRealtimeThread
+  */
+int ThreadWaitPeriod();
+
+
 
 /*******************************************
  *
@@ -760,6 +990,49 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/** @brief The number of buckets of the latency histogram of a @c schedinfo. */
+#define SCHEDINFO_BUCKETS 32
+
+/**
+  @brief Scheduler statistics of a core.
+
+  This structure is returned by scheduler information streams.
+  @see OpenSchedInfo
+ */
+typedef struct sched_info
+{
+  unsigned int core;         /**< @brief The core id */
+  unsigned long switches;    /**< @brief Context switches on the core */
+  unsigned long idle_time;   /**< @brief Microseconds spent running the idle thread */
+  unsigned long wakeups;     /**< @brief Threads that started running on the core after a wakeup */
+  unsigned long deadline_misses;  /**< @brief Deadline misses of real-time threads detected on the core */
+  unsigned long latency[SCHEDINFO_BUCKETS];  /**< @brief Histogram of wakeup-to-run latency.
+
+    Element 0 counts latencies below 1 microsecond, and element @c i>0 counts 
+    latencies in @c [2^(i-1),2^i) microseconds. The last element also counts
+    all longer latencies. The latency of a thread is the time from the moment
+    it is woken up until it starts running. */
+} schedinfo;
+
+/**
+  @brief Open a scheduler information stream.
+
+  This is a read-only stream that returns one @c schedinfo structure per core,
+  each packed into a block of size @c sizeof(schedinfo). Each read returns
+  one structure, so the buffer must have room for it; at the end of the stream,
+  read returns 0.
+
+  The statistics are cumulative since boot, and they are read while
+  the system runs, without any synchronization.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the available file ids for the process are exhausted.
+  @see ThreadInfo
+ */
+Fid_t OpenSchedInfo();
+
+
 
 
 /*******************************************
@@ -780,6 +1053,39 @@ Fid_t OpenInfo();
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
+/** @brief The scheduling policies of tinyos3. 
+
+  @see boot_policy
+ */
+typedef enum {
+  SCHED_POLICY_MLFQ, /**< @brief Multi-level feedback queue, favouring interactive threads (the default) */
+  SCHED_POLICY_RR,   /**< @brief Round-robin, in the order threads become ready */
+  SCHED_POLICY_CFS,  /**< @brief Fair share, running the thread that has run the least */
+  SCHED_POLICIES     /**< @brief The number of policies */
+} sched_policy;
+
+/** @brief Select the scheduling policy.
+
+  The policy is used by all subsequent calls to @c boot(). 
+
+  @param policy the new policy
+  @returns the previous policy, or -1 if @c policy is not valid
+ */
+int boot_policy(sched_policy policy);
+
+/** @brief Select whether the VM runs in virtual time.
+
+  In virtual time, the clock skips ahead whenever all cores are idle, 
+  to the next timeout. Thus, programs that sleep a lot (e.g., with 
+  @c ThreadWaitPeriod or timed waits) run much faster, and their timeouts
+  expire in a reproducible order. The setting is used by all subsequent 
+  calls to @c boot().
+
+  @param on non-zero to run in virtual time, 0 to run in real time
+  @returns the previous setting
+ */
+int boot_virtual_time(int on);
+
 
 /** @} */
 
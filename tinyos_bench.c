@@ -0,0 +1,1064 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "tinyos.h"
+#include "tinyoslib.h"
+#include "bios.h"
+#include "kernel_cc.h"
+
+
+/*
+	A standalone program holding micro-benchmarks for the TinyOS kernel.
+
+	Each benchmark boots the VM once per configuration, runs a workload
+	and reports a throughput figure measured on the host wall clock.
+	Note that the boot task gets a copy of its arguments, so the
+	configuration is passed by value.
+	The benchmarks are selected by name from the command line.
+ */
+
+
+/* Host wall clock in seconds, used to time whole boot() runs */
+static double wall_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1E-9;
+}
+
+
+
+/* Print the wakeup latency histogram of the scheduler, summed over all cores */
+static void print_wakeup_latency()
+{
+	unsigned long hist[SCHEDINFO_BUCKETS] = { 0 };
+	schedinfo info;
+
+	Fid_t fid = OpenSchedInfo();
+	while(Read(fid, (char*)&info, sizeof(info)) == sizeof(info))
+		for(int i=0; i<SCHEDINFO_BUCKETS; i++)
+			hist[i] += info.latency[i];
+	Close(fid);
+
+	printf("%16s %10s\n", "latency usec", "wakeups");
+	for(int i=0; i<SCHEDINFO_BUCKETS; i++)
+		if(hist[i])
+			printf("%7lu - %6lu %10lu\n", i ? 1ul<<(i-1) : 0, 1ul<<i, hist[i]);
+}
+
+
+
+/****************************************************
+
+	Context switch throughput
+
+	Pairs of threads ping-pong through a condition variable.
+	Every hand-off blocks one thread and wakes the other, so
+	each round is two context switches. The number of pairs
+	grows with the number of cores, so that a scheduler with
+	per-core queues should scale close to linearly.
+
+ ****************************************************/
+
+#define SWITCH_PAIRS_PER_CORE 4
+
+struct pingpong {
+	Mutex mx;
+	CondVar cv;
+	int turn;
+	int rounds;
+};
+
+static int pingpong_thread(int side, void* args)
+{
+	struct pingpong* pp = args;
+
+	Mutex_Lock(&pp->mx);
+	for(int i=0; i<pp->rounds; i++) {
+		while(pp->turn != side)
+			Cond_Wait(&pp->mx, &pp->cv);
+		pp->turn = 1-side;
+		Cond_Signal(&pp->cv);
+	}
+	Mutex_Unlock(&pp->mx);
+	return 0;
+}
+
+struct switch_config {
+	int npairs, rounds;
+};
+
+static int switch_boot(int argl, void* args)
+{
+	struct switch_config* cfg = args;
+	int npairs = cfg->npairs;
+	int rounds = cfg->rounds;
+	struct pingpong pp[npairs];
+	Tid_t tids[2*npairs];
+
+	for(int p=0; p<npairs; p++) {
+		pp[p].mx = MUTEX_INIT;
+		pp[p].cv = COND_INIT;
+		pp[p].turn = 0;
+		pp[p].rounds = rounds;
+		tids[2*p] = CreateThread(pingpong_thread, 0, &pp[p]);
+		tids[2*p+1] = CreateThread(pingpong_thread, 1, &pp[p]);
+	}
+
+	for(int t=0; t<2*npairs; t++)
+		ThreadJoin(tids[t], NULL);
+	return 0;
+}
+
+static void bench_switch(int maxcores, int argc, const char** argv)
+{
+	int rounds = (argc>0) ? atoi(argv[0]) : 20000;
+
+	printf("%6s %6s %14s %10s\n", "cores", "pairs", "switches/sec", "speedup");
+	double base = 0.0;
+	for(int ncores=1; ncores<=maxcores; ncores++) {
+		int npairs = SWITCH_PAIRS_PER_CORE*ncores;
+		struct switch_config cfg = { npairs, rounds };
+		double t0 = wall_time();
+		boot(ncores, 0, switch_boot, sizeof(cfg), &cfg);
+		double dt = wall_time()-t0;
+
+		double rate = 2.0*rounds*npairs / dt;
+		if(ncores==1) base = rate;
+		printf("%6d %6d %14.0f %10.2f\n", ncores, npairs, rate, rate/base);
+	}
+}
+
+
+
+/****************************************************
+
+	Scaling with the number of cores
+
+	A fixed number of compute-bound threads per core, each
+	doing its own work, with no sharing. The only shared state
+	is in the kernel and the VM (run queues, halt and interrupt
+	bookkeeping), so the speedup shows how well they scale.
+	The number of cores doubles, up to the number of processors
+	of the host (or the given number of cores, if smaller).
+
+ ****************************************************/
+
+#define SCALE_THREADS_PER_CORE 2
+
+struct scale_config {
+	int nthreads;
+	long work;
+};
+
+static int scale_thread(int argl, void* args)
+{
+	long work = *(long*)args;
+	volatile unsigned long x = argl;
+	for(long i=0; i<work; i++)
+		x = x*6364136223846793005ul + 1442695040888963407ul;
+	return 0;
+}
+
+static int scale_boot(int argl, void* args)
+{
+	struct scale_config* cfg = args;
+	Tid_t tids[cfg->nthreads];
+
+	for(int t=0; t<cfg->nthreads; t++)
+		tids[t] = CreateThread(scale_thread, t, &cfg->work);
+	for(int t=0; t<cfg->nthreads; t++)
+		ThreadJoin(tids[t], NULL);
+	return 0;
+}
+
+static void bench_scale(int maxcores, int argc, const char** argv)
+{
+	long work = (argc>0) ? atol(argv[0]) : 20000000;
+
+	int host = sysconf(_SC_NPROCESSORS_ONLN);
+	if(host > 0 && host < maxcores) maxcores = host;
+	printf("host processors: %d\n", host);
+
+	printf("%6s %8s %14s %10s\n", "cores", "threads", "Mwork/sec", "speedup");
+	double base = 0.0;
+	for(int ncores=1; ncores<=maxcores; ncores = (ncores<maxcores && 2*ncores>maxcores) ? maxcores : 2*ncores) {
+		struct scale_config cfg = { SCALE_THREADS_PER_CORE*ncores, work };
+		double t0 = wall_time();
+		boot(ncores, 0, scale_boot, sizeof(cfg), &cfg);
+		double dt = wall_time()-t0;
+
+		double rate = (double)work*cfg.nthreads / dt;
+		if(ncores==1) base = rate;
+		printf("%6d %8d %14.1f %10.2f\n", ncores, cfg.nthreads, rate*1E-6, rate/base);
+	}
+}
+
+
+
+/****************************************************
+
+	System call throughput
+
+	One thread per core makes system calls on its own objects:
+	GetPid, and a Write and a Read on its own null stream.
+	Since the calls share no kernel object, they should not
+	serialize, and the throughput should grow with the cores.
+	The number of cores doubles, as in the "scale" benchmark.
+
+ ****************************************************/
+
+#define SYSCALL_IO_SIZE 64
+
+static int syscall_thread(int argl, void* args)
+{
+	long rounds = *(long*)args;
+	char buf[SYSCALL_IO_SIZE];
+	memset(buf, 0, sizeof(buf));
+
+	Fid_t fid = OpenNull();
+	assert(fid != NOFILE);
+	for(long i=0; i<rounds; i++) {
+		GetPid();
+		Write(fid, buf, sizeof(buf));
+		Read(fid, buf, sizeof(buf));
+	}
+	Close(fid);
+	return 0;
+}
+
+static int syscall_boot(int argl, void* args)
+{
+	struct scale_config* cfg = args;
+	Tid_t tids[cfg->nthreads];
+
+	for(int t=0; t<cfg->nthreads; t++)
+		tids[t] = CreateThread(syscall_thread, t, &cfg->work);
+	for(int t=0; t<cfg->nthreads; t++)
+		ThreadJoin(tids[t], NULL);
+	return 0;
+}
+
+static void bench_syscalls(int maxcores, int argc, const char** argv)
+{
+	long rounds = (argc>0) ? atol(argv[0]) : 1000000;
+
+	int host = sysconf(_SC_NPROCESSORS_ONLN);
+	if(host > 0 && host < maxcores) maxcores = host;
+	printf("host processors: %d\n", host);
+
+	printf("%6s %8s %14s %10s\n", "cores", "threads", "Mcalls/sec", "speedup");
+	double base = 0.0;
+	for(int ncores=1; ncores<=maxcores; ncores = (ncores<maxcores && 2*ncores>maxcores) ? maxcores : 2*ncores) {
+		struct scale_config cfg = { ncores, rounds };
+		double t0 = wall_time();
+		boot(ncores, 0, syscall_boot, sizeof(cfg), &cfg);
+		double dt = wall_time()-t0;
+
+		/* Three calls per round */
+		double rate = 3.0*rounds*cfg.nthreads / dt;
+		if(ncores==1) base = rate;
+		printf("%6d %8d %14.2f %10.2f\n", ncores, cfg.nthreads, rate*1E-6, rate/base);
+	}
+}
+
+
+
+/****************************************************
+
+	Scheduler overhead versus ready threads
+
+	A herd of threads, each sleeping on its own condition variable,
+	is woken one by one, so that the whole herd is ready at once.
+	Every thread is then switched in once per round. With O(1)
+	selection, the switch rate should not depend on the herd size.
+	Each thread has its own mutex, so that the rate is not dominated
+	by contention on a single lock.
+
+ ****************************************************/
+
+struct herd {
+	Mutex mx;
+	CondVar done;
+	int arrived, nthreads, rounds;
+};
+
+struct herd_member {
+	Mutex mx;
+	CondVar cv;
+	int round;
+	struct herd* herd;
+};
+
+static int herd_thread(int argl, void* args)
+{
+	struct herd_member* m = args;
+	struct herd* h = m->herd;
+
+	Mutex_Lock(&m->mx);
+	for(int r=1; r<=h->rounds; r++) {
+		while(m->round < r)
+			Cond_Wait(&m->mx, &m->cv);
+		if(__atomic_add_fetch(&h->arrived, 1, __ATOMIC_ACQ_REL) == h->nthreads) {
+			Mutex_Lock(&h->mx);
+			Cond_Signal(&h->done);
+			Mutex_Unlock(&h->mx);
+		}
+	}
+	Mutex_Unlock(&m->mx);
+	return 0;
+}
+
+static int herd_boot(int argl, void* args)
+{
+	struct herd* h = args;
+	struct herd_member* M = malloc(h->nthreads*sizeof(struct herd_member));
+	Tid_t* tids = malloc(h->nthreads*sizeof(Tid_t));
+
+	for(int t=0; t<h->nthreads; t++) {
+		M[t].mx = MUTEX_INIT;
+		M[t].cv = COND_INIT;
+		M[t].round = 0;
+		M[t].herd = h;
+		tids[t] = CreateThread(herd_thread, 0, &M[t]);
+	}
+
+	for(int r=1; r<=h->rounds; r++) {
+		__atomic_store_n(&h->arrived, 0, __ATOMIC_RELEASE);
+		for(int t=0; t<h->nthreads; t++) {
+			Mutex_Lock(&M[t].mx);
+			M[t].round = r;
+			Cond_Signal(&M[t].cv);
+			Mutex_Unlock(&M[t].mx);
+		}
+
+		Mutex_Lock(&h->mx);
+		while(__atomic_load_n(&h->arrived, __ATOMIC_ACQUIRE) < h->nthreads)
+			Cond_Wait(&h->mx, &h->done);
+		Mutex_Unlock(&h->mx);
+	}
+
+	for(int t=0; t<h->nthreads; t++)
+		ThreadJoin(tids[t], NULL);
+	free(tids);
+	free(M);
+	return 0;
+}
+
+static void bench_herd(int ncores, int argc, const char** argv)
+{
+	int rounds = (argc>0) ? atoi(argv[0]) : 50;
+	int sizes[] = { 10, 100, 1000, 3000 };
+
+	printf("%6s %8s %14s\n", "cores", "threads", "switches/sec");
+	for(unsigned int i=0; i<sizeof(sizes)/sizeof(int); i++) {
+		struct herd h = { MUTEX_INIT, COND_INIT, 0, sizes[i], rounds };
+		double t0 = wall_time();
+		boot(ncores, 0, herd_boot, sizeof(h), &h);
+		double dt = wall_time()-t0;
+		printf("%6d %8d %14.0f\n", ncores, sizes[i], (double)rounds*sizes[i] / dt);
+	}
+}
+
+
+
+/****************************************************
+
+	Timed sleepers
+
+	Many threads sleep concurrently in Cond_TimedWait, each on its
+	own condition variable, with short pseudo-random timeouts that
+	always expire. The cost of registering and expiring timeouts 
+	under the scheduler lock shows up as a lower rate of timed waits 
+	as the number of sleepers grows.
+
+ ****************************************************/
+
+struct sleepers_config {
+	int nthreads, waits;
+};
+
+static int sleeper_thread(int argl, void* args)
+{
+	struct sleepers_config* cfg = args;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	unsigned int seed = argl;
+
+	Mutex_Lock(&mx);
+	for(int i=0; i<cfg->waits; i++)
+		Cond_TimedWait(&mx, &cv, 1 + rand_r(&seed) % 20);
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+static int sleepers_boot(int argl, void* args)
+{
+	struct sleepers_config* cfg = args;
+	Tid_t* tids = malloc(cfg->nthreads*sizeof(Tid_t));
+
+	for(int t=0; t<cfg->nthreads; t++)
+		tids[t] = CreateThread(sleeper_thread, t, cfg);
+	for(int t=0; t<cfg->nthreads; t++)
+		ThreadJoin(tids[t], NULL);
+
+	free(tids);
+	return 0;
+}
+
+static void bench_sleepers(int ncores, int argc, const char** argv)
+{
+	int waits = (argc>0) ? atoi(argv[0]) : 20;
+	int sizes[] = { 100, 1000, 10000 };
+
+	printf("%6s %8s %14s\n", "cores", "sleepers", "waits/sec");
+	for(unsigned int i=0; i<sizeof(sizes)/sizeof(int); i++) {
+		struct sleepers_config cfg = { sizes[i], waits };
+		double t0 = wall_time();
+		boot(ncores, 0, sleepers_boot, sizeof(cfg), &cfg);
+		double dt = wall_time()-t0;
+		printf("%6d %8d %14.0f\n", ncores, sizes[i], (double)waits*sizes[i] / dt);
+	}
+}
+
+
+
+/****************************************************
+
+	Timed wait latency
+
+	A single thread repeatedly sleeps in Cond_TimedWait for a
+	short timeout, on an otherwise idle VM. The average time per
+	wait, minus the timeout, is the wakeup latency.
+
+ ****************************************************/
+
+struct timedwait_config {
+	int waits, msec;
+};
+
+static int timedwait_boot(int argl, void* args)
+{
+	struct timedwait_config* cfg = args;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Mutex_Lock(&mx);
+	for(int i=0; i<cfg->waits; i++)
+		Cond_TimedWait(&mx, &cv, cfg->msec);
+	Mutex_Unlock(&mx);
+
+	print_wakeup_latency();
+	return 0;
+}
+
+static void bench_timedwait(int ncores, int argc, const char** argv)
+{
+	struct timedwait_config cfg = { 200, 1 };
+	if(argc>0) cfg.waits = atoi(argv[0]);
+	if(argc>1) cfg.msec = atoi(argv[1]);
+
+	double t0 = wall_time();
+	boot(ncores, 0, timedwait_boot, sizeof(cfg), &cfg);
+	double dt = wall_time()-t0;
+
+	double per_wait = 1E3*dt/cfg.waits;
+	printf("%6s %8s %12s %12s\n", "cores", "timeout", "msec/wait", "latency");
+	printf("%6d %8d %12.3f %12.3f\n", ncores, cfg.msec, per_wait, per_wait-cfg.msec);
+}
+
+
+
+/****************************************************
+
+	Thread and process creation
+
+	Threads (or processes) are created and joined (waited for)
+	in batches, so that the cost of allocating and releasing 
+	thread stacks dominates.
+
+ ****************************************************/
+
+#define SPAWN_BATCH 16
+
+struct spawn_config {
+	int count;
+	int procs;
+};
+
+static int spawn_child(int argl, void* args) { return argl; }
+
+static int spawn_boot(int argl, void* args)
+{
+	struct spawn_config* cfg = args;
+
+	for(int i=0; i<cfg->count; i+=SPAWN_BATCH) {
+		if(cfg->procs) {
+			for(int j=0; j<SPAWN_BATCH; j++) 
+				Exec(spawn_child, j, NULL);
+			for(int j=0; j<SPAWN_BATCH; j++) 
+				WaitChild(NOPROC, NULL);
+		} else {
+			Tid_t tids[SPAWN_BATCH];
+			for(int j=0; j<SPAWN_BATCH; j++) 
+				tids[j] = CreateThread(spawn_child, j, NULL);
+			for(int j=0; j<SPAWN_BATCH; j++) 
+				ThreadJoin(tids[j], NULL);
+		}
+	}
+	return 0;
+}
+
+static void bench_spawn(int ncores, int argc, const char** argv)
+{
+	int count = (argc>0) ? atoi(argv[0]) : 20000;
+
+	printf("%6s %10s %14s\n", "cores", "kind", "spawns/sec");
+	for(int procs=0; procs<=1; procs++) {
+		struct spawn_config cfg = { count, procs };
+		double t0 = wall_time();
+		boot(ncores, 0, spawn_boot, sizeof(cfg), &cfg);
+		double dt = wall_time()-t0;
+		printf("%6d %10s %14.0f\n", ncores, procs ? "Exec" : "Thread", count / dt);
+	}
+}
+
+
+
+/****************************************************
+
+	Priority inversion
+
+	A CPU-bound thread, which the MLFQ has pushed to a low level,
+	repeatedly holds a mutex for a while. A prober thread sleeps
+	briefly (so it stays at a high level) and then takes the same
+	mutex. Background CPU-bound threads compete with the holder.
+	Without priority inheritance, the prober waits until the holder
+	gets its turn behind the background threads, so its latency
+	grows with the background load.
+
+ ****************************************************/
+
+#define INVERSION_HOLD_USEC 200
+
+struct inversion_result {
+	double avg, max;
+};
+
+struct inversion_config {
+	int probes;
+	int background;
+	struct inversion_result* result;
+};
+
+struct inversion {
+	Mutex mx;
+	volatile int stop;
+};
+
+static void spin_usec(double usec)
+{
+	double t0 = wall_time();
+	while((wall_time()-t0)*1E6 < usec);
+}
+
+static int inversion_holder(int argl, void* args)
+{
+	struct inversion* inv = args;
+	while(! inv->stop) {
+		Mutex_Lock(&inv->mx);
+		spin_usec(INVERSION_HOLD_USEC);
+		Mutex_Unlock(&inv->mx);
+		spin_usec(INVERSION_HOLD_USEC);
+	}
+	return 0;
+}
+
+static int inversion_hog(int argl, void* args)
+{
+	struct inversion* inv = args;
+	while(! inv->stop);
+	return 0;
+}
+
+static int inversion_boot(int argl, void* args)
+{
+	struct inversion_config* cfg = args;
+	struct inversion inv = { MUTEX_INIT, 0 };
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Tid_t holder = CreateThread(inversion_holder, 0, &inv);
+	Tid_t hogs[cfg->background];
+	for(int i=0; i<cfg->background; i++)
+		hogs[i] = CreateThread(inversion_hog, 0, &inv);
+
+	/* Let the CPU-bound threads sink to the low levels */
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+
+	double sum = 0, max = 0;
+	for(int i=0; i<cfg->probes; i++) {
+		Cond_TimedWait(&mx, &cv, 1);
+		double t0 = wall_time();
+		Mutex_Lock(&inv.mx);
+		double dt = wall_time()-t0;
+		Mutex_Unlock(&inv.mx);
+		sum += dt;
+		if(dt > max) max = dt;
+	}
+	Mutex_Unlock(&mx);
+
+	inv.stop = 1;
+	ThreadJoin(holder, NULL);
+	for(int i=0; i<cfg->background; i++)
+		ThreadJoin(hogs[i], NULL);
+
+	cfg->result->avg = sum / cfg->probes;
+	cfg->result->max = max;
+	return 0;
+}
+
+static void bench_inversion(int ncores, int argc, const char** argv)
+{
+	int probes = (argc>0) ? atoi(argv[0]) : 500;
+	int loads[] = { 0, 2, 8 };
+
+	printf("%6s %10s %14s %14s\n", "cores", "background", "avg usec", "max usec");
+	for(int i=0; i<3; i++) {
+		struct inversion_result res;
+		struct inversion_config cfg = { probes, loads[i], &res };
+		boot(ncores, 0, inversion_boot, sizeof(cfg), &cfg);
+		printf("%6d %10d %14.1f %14.1f\n", ncores, loads[i], 1E6*res.avg, 1E6*res.max);
+	}
+}
+
+
+
+/****************************************************
+
+	Mutex contention
+
+	A growing number of threads increment a shared counter under
+	a single mutex, holding it for a short critical section. Besides
+	the lock rate, the host CPU time spent per lock shows how much
+	of the machine the waiters burn: parked waiters should not add
+	to it as the threads outnumber the cores.
+
+ ****************************************************/
+
+#define CONTENTION_HOLD 200
+
+struct contention {
+	Mutex mx;
+	long counter;
+	long locks;
+};
+
+static int contention_thread(int argl, void* args)
+{
+	struct contention* c = args;
+	for(long i=0; i<c->locks; i++) {
+		Mutex_Lock(&c->mx);
+		volatile long x = c->counter;
+		for(int k=0; k<CONTENTION_HOLD; k++) x++;
+		c->counter = x - CONTENTION_HOLD + 1;
+		Mutex_Unlock(&c->mx);
+	}
+	return 0;
+}
+
+static int contention_boot(int argl, void* args)
+{
+	struct scale_config* cfg = args;
+	struct contention c = { MUTEX_INIT, 0, cfg->work };
+	Tid_t tids[cfg->nthreads];
+
+	for(int t=0; t<cfg->nthreads; t++)
+		tids[t] = CreateThread(contention_thread, t, &c);
+	for(int t=0; t<cfg->nthreads; t++)
+		ThreadJoin(tids[t], NULL);
+	assert(c.counter == c.locks*cfg->nthreads);
+	return 0;
+}
+
+static void bench_contention(int ncores, int argc, const char** argv)
+{
+	long locks = (argc>0) ? atol(argv[0]) : 100000;
+	int loads[] = { 1, 2, 8, 32 };
+
+	printf("%6s %8s %14s %14s\n", "cores", "threads", "Mlocks/sec", "cpu usec/lock");
+	for(int i=0; i<4; i++) {
+		struct scale_config cfg = { loads[i]*ncores, locks };
+		clock_t c0 = clock();
+		double t0 = wall_time();
+		boot(ncores, 0, contention_boot, sizeof(cfg), &cfg);
+		double dt = wall_time()-t0;
+		double cpu = (double)(clock()-c0) / CLOCKS_PER_SEC;
+
+		double total = (double)locks*cfg.nthreads;
+		printf("%6d %8d %14.2f %14.3f\n", ncores, cfg.nthreads, total/dt*1E-6, 1E6*cpu/total);
+	}
+}
+
+
+
+/****************************************************
+
+	Spinlock contention
+
+	One thread per core, pinned to it, locks a single kernel lock
+	in the non-preemptive domain and updates a shared counter.
+	The lock is either a Mutex, which then spins with test-and-set
+	on the lock word, or a queued Spinlock, where each core spins on
+	its own node. The number of cores doubles, up to the number
+	of processors of the host; beyond that, the spinlocks fall
+	back to test-and-set (see initialize_spinlocks()).
+
+ ****************************************************/
+
+#define SPIN_HOLD 50
+
+struct spin_config {
+	int nthreads;
+	long locks;
+	int queued;
+};
+
+struct spin_contention {
+	Mutex mx;
+	Spinlock sl;
+	int queued;
+	long counter;
+	long locks;
+};
+
+static int spin_thread(int argl, void* args)
+{
+	struct spin_contention* c = args;
+	coreset_t set;
+	CORESET_ZERO(&set);
+	CORESET_SET(argl, &set);
+	ThreadSetAffinity(ThreadSelf(), &set);
+
+	for(long i=0; i<c->locks; i++) {
+		int preempt = preempt_off;
+		if(c->queued) Spinlock_Lock(&c->sl); else Mutex_Lock(&c->mx);
+		volatile long x = c->counter;
+		for(int k=0; k<SPIN_HOLD; k++) x++;
+		c->counter = x - SPIN_HOLD + 1;
+		if(c->queued) Spinlock_Unlock(&c->sl); else Mutex_Unlock(&c->mx);
+		if(preempt) preempt_on;
+	}
+	return 0;
+}
+
+static int spin_boot(int argl, void* args)
+{
+	struct spin_config* cfg = args;
+	struct spin_contention c = { MUTEX_INIT, SPINLOCK_INIT, cfg->queued, 0, cfg->locks };
+	Tid_t tids[cfg->nthreads];
+
+	for(int t=0; t<cfg->nthreads; t++)
+		tids[t] = CreateThread(spin_thread, t, &c);
+	for(int t=0; t<cfg->nthreads; t++)
+		ThreadJoin(tids[t], NULL);
+	assert(c.counter == c.locks*cfg->nthreads);
+	return 0;
+}
+
+static void bench_spinlocks(int maxcores, int argc, const char** argv)
+{
+	long locks = (argc>0) ? atol(argv[0]) : 200000;
+
+	int host = sysconf(_SC_NPROCESSORS_ONLN);
+	if(host > 0 && host < maxcores) maxcores = host;
+	printf("host processors: %d\n", host);
+
+	printf("%6s %16s %16s\n", "cores", "tas Mlocks/sec", "mcs Mlocks/sec");
+	for(int ncores=1; ncores<=maxcores; ncores = (ncores<maxcores && 2*ncores>maxcores) ? maxcores : 2*ncores) {
+		double rate[2];
+		for(int queued=0; queued<2; queued++) {
+			struct spin_config cfg = { ncores, locks, queued };
+			double t0 = wall_time();
+			boot(ncores, 0, spin_boot, sizeof(cfg), &cfg);
+			rate[queued] = (double)locks*ncores / (wall_time()-t0);
+		}
+		printf("%6d %16.2f %16.2f\n", ncores, rate[0]*1E-6, rate[1]*1E-6);
+	}
+}
+
+
+
+/****************************************************
+
+	Scheduling policies
+
+	The same workloads run under each scheduling policy (see
+	boot_policy()). Throughput is the switch rate of a herd of
+	ready threads, as in the herd benchmark. Latency is the delay
+	with which an interactive thread, which sleeps for 1 msec at a
+	time, gets a core back from CPU-bound hogs, on top of its sleep.
+	Inversion is the average of the inversion benchmark, with 8
+	background threads.
+
+ ****************************************************/
+
+#define POLICY_HERD 100
+#define POLICY_HOGS 4
+
+struct latency_config {
+	int sleeps;
+	int hogs;
+	struct inversion_result* result;
+};
+
+static int latency_boot(int argl, void* args)
+{
+	struct latency_config* cfg = args;
+	struct inversion inv = { MUTEX_INIT, 0 };
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Tid_t hogs[cfg->hogs];
+	for(int i=0; i<cfg->hogs; i++)
+		hogs[i] = CreateThread(inversion_hog, 0, &inv);
+
+	double sum = 0, max = 0;
+	Mutex_Lock(&mx);
+	for(int i=0; i<cfg->sleeps; i++) {
+		double t0 = wall_time();
+		Cond_TimedWait(&mx, &cv, 1);
+		double dt = wall_time()-t0-1E-3;
+		if(dt < 0) dt = 0;
+		sum += dt;
+		if(dt > max) max = dt;
+	}
+	Mutex_Unlock(&mx);
+
+	inv.stop = 1;
+	for(int i=0; i<cfg->hogs; i++)
+		ThreadJoin(hogs[i], NULL);
+
+	cfg->result->avg = sum / cfg->sleeps;
+	cfg->result->max = max;
+	return 0;
+}
+
+static void bench_policies(int ncores, int argc, const char** argv)
+{
+	int rounds = (argc>0) ? atoi(argv[0]) : 20;
+	const char* names[SCHED_POLICIES] = { "mlfq", "rr", "cfs" };
+
+	printf("%6s %6s %14s %14s %14s %14s\n", "policy", "cores", 
+		"switches/sec", "latency avg", "latency max", "inversion avg");
+	for(int p=0; p<SCHED_POLICIES; p++) {
+		boot_policy(p);
+
+		struct herd h = { MUTEX_INIT, COND_INIT, 0, POLICY_HERD, rounds };
+		double t0 = wall_time();
+		boot(ncores, 0, herd_boot, sizeof(h), &h);
+		double dt = wall_time()-t0;
+
+		struct inversion_result lat;
+		struct latency_config lcfg = { 10*rounds, POLICY_HOGS, &lat };
+		boot(ncores, 0, latency_boot, sizeof(lcfg), &lcfg);
+
+		struct inversion_result inv;
+		struct inversion_config icfg = { rounds, 8, &inv };
+		boot(ncores, 0, inversion_boot, sizeof(icfg), &icfg);
+
+		printf("%6s %6d %14.0f %14.1f %14.1f %14.1f\n", names[p], ncores, 
+			(double)rounds*POLICY_HERD / dt, 1E6*lat.avg, 1E6*lat.max, 1E6*inv.avg);
+	}
+	boot_policy(SCHED_POLICY_MLFQ);
+}
+
+
+
+/****************************************************/
+
+/****************************************************
+
+	Raw context switch cost
+
+	Two contexts on the host thread ping-pong with cpu_swap_context(),
+	outside the VM, so that only the switch itself is timed. The same
+	ping-pong through glibc swapcontext(), which saves the signal mask 
+	with a system call, is timed for comparison. The cores argument is 
+	not used.
+
+ ****************************************************/
+
+#define CTX_STACK_SIZE (64*1024)
+
+static cpu_context_t ctx_main, ctx_peer;
+static ucontext_t uctx_main, uctx_peer;
+
+static void ctx_peer_loop()
+{
+	for(;;)
+		cpu_swap_context(&ctx_peer, &ctx_main);
+}
+
+static void uctx_peer_loop()
+{
+	for(;;)
+		swapcontext(&uctx_peer, &uctx_main);
+}
+
+static void bench_ctxswitch(int ncores, int argc, const char** argv)
+{
+	long rounds = (argc>0) ? atol(argv[0]) : 1000000;
+	void* stack = malloc(CTX_STACK_SIZE);
+	void* ustack = malloc(CTX_STACK_SIZE);
+
+	cpu_initialize_context(&ctx_peer, stack, CTX_STACK_SIZE, ctx_peer_loop);
+	double t0 = wall_time();
+	for(long i=0; i<rounds; i++)
+		cpu_swap_context(&ctx_main, &ctx_peer);
+	double dt = wall_time()-t0;
+
+	getcontext(&uctx_peer);
+	uctx_peer.uc_link = NULL;
+	uctx_peer.uc_stack.ss_sp = ustack;
+	uctx_peer.uc_stack.ss_size = CTX_STACK_SIZE;
+	uctx_peer.uc_stack.ss_flags = 0;
+	makecontext(&uctx_peer, uctx_peer_loop, 0);
+	double ut0 = wall_time();
+	for(long i=0; i<rounds; i++)
+		swapcontext(&uctx_main, &uctx_peer);
+	double udt = wall_time()-ut0;
+
+	/* Each round is two switches */
+	printf("%18s %14s %10s\n", "switch", "switches/sec", "nsec");
+	printf("%18s %14.0f %10.1f\n", "cpu_swap_context", 2.0*rounds/dt, dt*1E9/(2.0*rounds));
+	printf("%18s %14.0f %10.1f\n", "swapcontext", 2.0*rounds/udt, udt*1E9/(2.0*rounds));
+	printf("speedup %.2f\n", udt/dt);
+
+	free(stack);
+	free(ustack);
+}
+
+
+/****************************************************
+
+	Clock cost and resolution
+
+	Every context switch reads bios_clock() a few times, to 
+	account runtime and to check timeouts. This measures the 
+	cost of a call and the smallest step of the clock, against 
+	the coarse wall clock that bios_clock() used to read, and 
+	the drift of bios_clock() from CLOCK_MONOTONIC over the run.
+
+ ****************************************************/
+
+static TimerDuration coarse_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return ts.tv_sec*1000000ull + ts.tv_nsec/1000;
+}
+
+static int clock_boot(int argl, void* args)
+{
+	long calls = *(long*)args;
+	TimerDuration (*clocks[2])() = { bios_clock, coarse_clock };
+	const char* names[2] = { "bios_clock", "REALTIME_COARSE" };
+	double start = wall_time();
+	double offset0 = bios_clock()*1E-6 - start;
+
+	printf("%18s %10s %14s\n", "clock", "nsec/call", "step usec");
+	for(int k=0; k<2; k++) {
+		/* Cost per call; the sum keeps the calls from being optimized out */
+		volatile TimerDuration sum = 0;
+		double t0 = wall_time();
+		for(long i=0; i<calls; i++)
+			sum += clocks[k]();
+		double dt = wall_time()-t0;
+
+		/* Resolution: the smallest increment seen between successive reads */
+		TimerDuration step = ~(TimerDuration)0;
+		TimerDuration prev = clocks[k]();
+		for(long i=0; i<calls; i++) {
+			TimerDuration t = clocks[k]();
+			if(t != prev && t-prev < step) step = t-prev;
+			prev = t;
+		}
+		printf("%18s %10.1f %14lu\n", names[k], dt*1E9/calls, (unsigned long)step);
+	}
+
+	double end = wall_time();
+	double offset1 = bios_clock()*1E-6 - end;
+	printf("drift %.1f usec in %.2f sec\n", (offset1-offset0)*1E6, end-start);
+	return 0;
+}
+
+static void bench_clock(int ncores, int argc, const char** argv)
+{
+	long calls = (argc>0) ? atol(argv[0]) : 10000000;
+	boot(1, 0, clock_boot, sizeof(calls), &calls);
+}
+
+
+
+struct benchmark {
+	const char* name;
+	void (*run)(int ncores, int argc, const char** argv);
+	const char* help;
+};
+
+static struct benchmark benchmarks[] = {
+	{ "switch", bench_switch, "[rounds]  context switches/sec for 1..cores cores" },
+	{ "ctxswitch", bench_ctxswitch, "[rounds]  cost of a bare cpu_swap_context() versus swapcontext()" },
+	{ "clock", bench_clock, "[calls]  cost, resolution and drift of bios_clock() versus the host clocks" },
+	{ "scale", bench_scale, "[work]  compute throughput as the cores double, up to the host processors" },
+	{ "syscalls", bench_syscalls, "[rounds]  throughput of system calls on private objects as the cores double" },
+	{ "herd", bench_herd, "[rounds]  switches/sec as the number of ready threads grows" },
+	{ "sleepers", bench_sleepers, "[waits]  timed waits/sec with up to 10k concurrent sleepers" },
+	{ "spawn", bench_spawn, "[count]  CreateThread/ThreadJoin and Exec/WaitChild per sec" },
+	{ "timedwait", bench_timedwait, "[waits] [msec]  wakeup latency of Cond_TimedWait on an idle VM" },
+	{ "contention", bench_contention, "[locks]  lock rate and host cpu per lock as threads contend on one mutex" },
+	{ "spinlocks", bench_spinlocks, "[locks]  test-and-set versus queued kernel spinlocks as the cores double" },
+	{ "inversion", bench_inversion, "[probes]  lock latency of a high-priority thread against a low-priority holder" },
+	{ "policies", bench_policies, "[rounds]  throughput and latency under each scheduling policy" },
+	{ NULL, NULL, NULL }
+};
+
+static void usage(const char* pname)
+{
+	printf("usage:\n  %s [-T] <benchmark> <cores> [args...]\n\n"
+		"  -T runs the VM in virtual time, and <benchmark> is one of:\n", pname);
+	for(struct benchmark* b=benchmarks; b->name; b++)
+		printf("    %-10s %s\n", b->name, b->help);
+	exit(1);
+}
+
+int main(int argc, const char** argv)
+{
+	const char* pname = argv[0];
+	if(argc>1 && strcmp(argv[1], "-T")==0) {
+		boot_virtual_time(1);
+		argc--; argv++;
+	}
+	if(argc<3) usage(pname);
+
+	int ncores = atoi(argv[2]);
+	if(ncores<1 || ncores>MAX_CORES) {
+		printf("cores must be between 1 and %d\n", MAX_CORES);
+		exit(1);
+	}
+
+	for(struct benchmark* b=benchmarks; b->name; b++)
+		if(strcmp(b->name, argv[1])==0) {
+			b->run(ncores, argc-3, argv+3);
+			return 0;
+		}
+
+	usage(pname);
+	return 1;
+}
@@ -835,6 +835,8 @@ static struct argp_option options [] = {
 	{"list", 'l', 0, 0, "Show a list of available tests" },
 	{"verbose", 'v', 0, 0, "Be verbose: show test descriptions"},
 	{"nocolor", 'n', 0, 0, "Do not color the output"},
+	{"sched", 's', "<policy>", 0, "Scheduling policy: mlfq (default), rr or cfs" },
+	{"vtime", 'T', 0, 0, "Run the VM in virtual time" },
 	{ NULL }
 };
 
@@ -948,6 +950,17 @@ parse_options(int key, char *arg, struct argp_state *state)
 				argp_error(state, "Error in parsing list of terminals: %s\n",arg);				
 			break;
 
+		case 's':
+			if(strcmp(arg, "mlfq")==0) boot_policy(SCHED_POLICY_MLFQ);
+			else if(strcmp(arg, "rr")==0) boot_policy(SCHED_POLICY_RR);
+			else if(strcmp(arg, "cfs")==0) boot_policy(SCHED_POLICY_CFS);
+			else argp_error(state, "Unknown scheduling policy: %s\n",arg);
+			break;
+
+		case 'T':
+			boot_virtual_time(1);
+			break;
+
 		case ARGP_KEY_ARG:
 			if(ARGS.ntests >= MAX_TESTS) {
 				argp_error(state, "Number of tests too large (maximum=%d)",MAX_TESTS);
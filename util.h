@@ -18,6 +18,7 @@
 	This file defines the following:
 	- macros for error checking and message reporting
 	- a _resource list_ data structure
+	- multi-word bitmaps
 
 	Resource list
 	--------------
@@ -581,6 +582,74 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/*******************************************************
+ *
+ * Bitmaps
+ *
+ *******************************************************/
+
+/**
+	@defgroup bitmaps  Multi-word bitmaps
+
+	@brief Fixed-size bit sets stored in arrays of 64-bit words.
+
+	A bitmap of @c n bits is declared as an array of @c BITMAP_WORDS(n)
+	words of type @c uint64_t. Bit @c i lives in word @c i/64, at position
+	@c i%64. The search functions take the number of words, so that they
+	can be used on bitmaps of any size. Bits beyond @c n must be kept zero.
+
+	@{
+ */
+
+/** @brief The number of words needed for a bitmap of @c nbits bits. */
+#define BITMAP_WORDS(nbits)  (((nbits)+63)/64)
+
+/** @brief Set bit @c i of bitmap @c bm. */
+static inline void bitmap_set(uint64_t* bm, unsigned int i) { bm[i>>6] |= (UINT64_C(1) << (i&63)); }
+
+/** @brief Clear bit @c i of bitmap @c bm. */
+static inline void bitmap_clear(uint64_t* bm, unsigned int i) { bm[i>>6] &= ~(UINT64_C(1) << (i&63)); }
+
+/** @brief Return non-zero iff bit @c i of bitmap @c bm is set. */
+static inline int bitmap_test(const uint64_t* bm, unsigned int i) { return (bm[i>>6] >> (i&63)) & 1; }
+
+/**
+	@brief Return the index of the lowest set bit, or -1 if the bitmap is empty.
+ */
+static inline int bitmap_find_first(const uint64_t* bm, unsigned int nwords)
+{
+	for(unsigned int w=0; w<nwords; w++)
+		if(bm[w]) return (w<<6) + __builtin_ctzll(bm[w]);
+	return -1;
+}
+
+/**
+	@brief Return the index of the highest set bit, or -1 if the bitmap is empty.
+ */
+static inline int bitmap_find_last(const uint64_t* bm, unsigned int nwords)
+{
+	for(int w=nwords-1; w>=0; w--)
+		if(bm[w]) return (w<<6) + 63 - __builtin_clzll(bm[w]);
+	return -1;
+}
+
+/**
+	@brief Shift a bitmap by one position towards the higher bits.
+
+	Bit @c i moves to bit @c i+1 and bit 0 becomes zero. The top bit of
+	the last word is shifted out; the caller must fold it back if needed.
+ */
+static inline void bitmap_shl1(uint64_t* bm, unsigned int nwords)
+{
+	for(int w=nwords-1; w>0; w--)
+		bm[w] = (bm[w] << 1) | (bm[w-1] >> 63);
+	bm[0] <<= 1;
+}
+
+/* @} bitmaps */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
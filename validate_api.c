@@ -375,27 +375,21 @@ BOOT_TEST(test_orphans_adopted_by_init,
 	Test that a timed wait on a condition variable terminates after the timeout.
  */
 
-static unsigned long tspec2msec(struct timespec t)
-{
-	return 1000ul*t.tv_sec + t.tv_nsec/1000000ul;
-}
-
-
 static int do_timeout(int argl, void* args) {
 	timeout_t t = *((timeout_t *) args);
 
 	Mutex mx = MUTEX_INIT;
 	CondVar cv = COND_INIT;
 
-	struct timespec t1, t2;
-	clock_gettime(CLOCK_REALTIME, &t1);
+	/* Measure on the VM clock, which also works in virtual time */
+	TimerDuration t1 = bios_clock();
 
 	Mutex_Lock(&mx);
 	Cond_TimedWait(&mx, &cv, t);
 
-	clock_gettime(CLOCK_REALTIME, &t2);
+	TimerDuration t2 = bios_clock();
 
-	unsigned long Dt = tspec2msec(t2)-tspec2msec(t1);
+	unsigned long Dt = (t2-t1)/1000ul;
 
 	/* Allow a large, 20% error */
 	ASSERT(abs(Dt-t)*5 <= Dt);
@@ -2575,11 +2569,548 @@ BARE_TEST(dummy_user_test,
 }
 
 
+static int stack_size_child(int argl, void* args)
+{
+	ASSERT(SetStackSize(0)==32*1024);
+	return 0;
+}
+
+BOOT_TEST(test_set_stack_size,
+	"Test that SetStackSize rounds sizes, rejects large sizes and is inherited by children")
+{
+	ASSERT(SetStackSize(0)==128*1024);
+	ASSERT(SetStackSize(20000)==128*1024);
+	ASSERT(SetStackSize(0)==32*1024);
+	ASSERT(SetStackSize(STACK_SIZE_MAX+1)==-1);
+	ASSERT(SetStackSize(0)==32*1024);
+	ASSERT(run_get_status(stack_size_child, 0, NULL)==0);
+
+	ASSERT(SetStackSize(1)==32*1024);
+	ASSERT(SetStackSize(STACK_SIZE_MAX)==STACK_SIZE_MIN);
+	ASSERT(SetStackSize(0)==STACK_SIZE_MAX);
+	return 0;
+}
+
+
+static int deep_stack_thread(int argl, void* args)
+{
+	volatile char buffer[argl];
+	for(int i=0; i<argl; i++) buffer[i] = i;
+	return buffer[argl-1];
+}
+
+BOOT_TEST(test_thread_info_stack_used,
+	"Test that ThreadInfo reports the stack size and high-water mark of threads")
+{
+	threadinfo info;
+	ASSERT(ThreadInfo(NOTHREAD, &info)==-1);
+	ASSERT(ThreadInfo(ThreadSelf(), NULL)==-1);
+
+	ASSERT(ThreadInfo(ThreadSelf(), &info)==0);
+	ASSERT(info.tid == ThreadSelf());
+	ASSERT(!info.exited);
+	ASSERT(info.stack_size == 128*1024);
+	ASSERT(info.stack_used <= info.stack_size);
+
+	SetStackSize(64*1024);
+	Tid_t t = CreateThread(deep_stack_thread, 40000, NULL);
+	ASSERT(t!=NOTHREAD);
+	do {
+		ASSERT(ThreadInfo(t, &info)==0);
+	} while(!info.exited);
+
+	ASSERT(info.stack_size == 64*1024);
+#ifdef THREAD_STACK_CANARY
+	ASSERT(info.stack_used >= 40000);
+	ASSERT(info.stack_used <= info.stack_size);
+#else
+	ASSERT(info.stack_used == 0);
+#endif
+
+	/* A joined thread is gone */
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(ThreadInfo(t, &info)==-1);
+	return 0;
+}
+
+
+static int affinity_child(int argl, void* args)
+{
+	coreset_t set;
+	ASSERT(ThreadGetAffinity(ThreadSelf(), &set)==0);
+	ASSERT(CORESET_ISSET(0, &set));
+	ASSERT(!CORESET_ISSET(1, &set));
+	return 0;
+}
+
+static int affinity_worker(int argl, void* args)
+{
+	int sum = 0;
+	for(int i=0; i<argl; i++) {
+		sum += i;
+		if(i % 1000 == 0) {
+			coreset_t set;
+			CORESET_ZERO(&set);
+			CORESET_SET(0, &set);
+			if(i % 2000 == 0) CORESET_FILL(&set);
+			ASSERT(ThreadSetAffinity(ThreadSelf(), &set)==0);
+		}
+	}
+	return sum != 0;
+}
+
+BOOT_TEST(test_thread_affinity,
+	"Test that ThreadSetAffinity and ThreadGetAffinity store, validate and inherit the affinity"
+	)
+{
+	coreset_t set;
+
+	/* Initially, every core is allowed */
+	ASSERT(ThreadGetAffinity(ThreadSelf(), &set)==0);
+	for(int c=0; c<CORESET_SIZE; c++)
+		ASSERT(CORESET_ISSET(c, &set));
+
+	/* Errors */
+	ASSERT(ThreadGetAffinity(NOTHREAD, &set)==-1);
+	ASSERT(ThreadGetAffinity(ThreadSelf(), NULL)==-1);
+	ASSERT(ThreadSetAffinity(ThreadSelf(), NULL)==-1);
+	CORESET_ZERO(&set);
+	ASSERT(ThreadSetAffinity(ThreadSelf(), &set)==-1);
+	if(cpu_cores() < CORESET_SIZE) {
+		/* Only a core that does not exist */
+		CORESET_SET(cpu_cores(), &set);
+		ASSERT(ThreadSetAffinity(ThreadSelf(), &set)==-1);
+	}
+
+	/* Pin to core 0, children inherit it */
+	CORESET_ZERO(&set);
+	CORESET_SET(0, &set);
+	ASSERT(ThreadSetAffinity(ThreadSelf(), &set)==0);
+	ASSERT(run_get_status(affinity_child, 0, NULL)==0);
+
+	int exitval;
+	Tid_t t = CreateThread(affinity_child, 0, NULL);
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+
+	/* Threads that keep moving still finish */
+	Tid_t w[4];
+	for(int i=0; i<4; i++)
+		w[i] = CreateThread(affinity_worker, 100000, NULL);
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(w[i], &exitval)==0 && exitval==1);
+	return 0;
+}
+
+
+static int flag_setter(int argl, void* args)
+{
+	*(volatile int*) args = 1;
+	return 0;
+}
+
+BOOT_TEST(test_preemption_of_spinning_thread,
+	"Test that a thread spinning on a flag is preempted, so that the thread that sets it can run.",
+	.timeout = 10
+	)
+{
+	volatile int flag = 0;
+	Tid_t t = CreateThread(flag_setter, 0, (void*) &flag);
+	while(! flag);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+struct inversion {
+	Mutex mx;
+	volatile int stop;
+};
+
+static void spin_for(TimerDuration usec)
+{
+	TimerDuration t0 = bios_clock();
+	while(bios_clock() - t0 < usec);
+}
+
+/* A CPU-bound thread that holds the mutex for two quanta at a time */
+static int inversion_holder(int argl, void* args)
+{
+	struct inversion* inv = args;
+	while(! inv->stop) {
+		Mutex_Lock(&inv->mx);
+		spin_for(20000);
+		Mutex_Unlock(&inv->mx);
+		spin_for(1000);
+	}
+	return 0;
+}
+
+static int inversion_hog(int argl, void* args)
+{
+	struct inversion* inv = args;
+	while(! inv->stop);
+	return 0;
+}
+
+/* The average time for a thread that sleeps between locks to get the mutex */
+static TimerDuration inversion_latency(int hogs)
+{
+	struct inversion inv = { MUTEX_INIT, 0 };
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Tid_t holder = CreateThread(inversion_holder, 0, &inv);
+	Tid_t hog[hogs];
+	for(int i=0; i<hogs; i++)
+		hog[i] = CreateThread(inversion_hog, 0, &inv);
+
+	/* Let the CPU-bound threads sink to the low levels */
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+
+	const int probes = 30;
+	TimerDuration total = 0;
+	for(int i=0; i<probes; i++) {
+		Cond_TimedWait(&mx, &cv, 3);
+		TimerDuration t0 = bios_clock();
+		Mutex_Lock(&inv.mx);
+		total += bios_clock() - t0;
+		Mutex_Unlock(&inv.mx);
+	}
+	Mutex_Unlock(&mx);
+
+	inv.stop = 1;
+	ThreadJoin(holder, NULL);
+	for(int i=0; i<hogs; i++)
+		ThreadJoin(hog[i], NULL);
+	return total / probes;
+}
+
+BOOT_TEST(test_priority_inheritance,
+	"Test that a waiter of a mutex held by a low-priority thread does not wait for CPU-bound threads",
+	.timeout = 30
+	)
+{
+	/* All on one core, so that the threads compete */
+	coreset_t set;
+	CORESET_ZERO(&set);
+	CORESET_SET(0, &set);
+	ASSERT(ThreadSetAffinity(ThreadSelf(), &set)==0);
+
+	TimerDuration idle = inversion_latency(0);
+	TimerDuration loaded = inversion_latency(8);
+
+	/* Without inheritance, the holder would share the core with the hogs for a few quanta */
+	ASSERT_MSG(loaded < idle + 10000, "latency %lu usec without load, %lu usec with load\n",
+		(unsigned long) idle, (unsigned long) loaded);
+	return 0;
+}
+
+
+static int preempted_thread(int argl, void* args)
+{
+	threadinfo info;
+	do {
+		for(volatile int i=0; i<1000000; i++);
+		ASSERT(ThreadInfo(ThreadSelf(), &info)==0);
+	} while(info.involuntary_switches < 2);
+	return 0;
+}
+
+BOOT_TEST(test_thread_info_accounting,
+	"Test that ThreadInfo reports the running time and context switches of threads"
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	/* Poll rarely, so that t is preempted rather than yielding */
+	Tid_t t = CreateThread(preempted_thread, 0, NULL);
+	threadinfo info;
+	Mutex_Lock(&mx);
+	do {
+		Cond_TimedWait(&mx, &cv, 10);
+		ASSERT(ThreadInfo(t, &info)==0);
+	} while(!info.exited);
+	Mutex_Unlock(&mx);
+
+	ASSERT(info.involuntary_switches >= 2);
+	ASSERT(info.runtime > 0);
+	unsigned long level_total = 0;
+	for(int i=0; i<THREADINFO_LEVELS; i++)
+		level_total += info.level_time[i];
+	ASSERT(level_total == info.runtime);
+
+	/* We slept, at least */
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(ThreadInfo(ThreadSelf(), &info)==0);
+	ASSERT(info.voluntary_switches > 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_info,
+	"Test that the scheduler info stream returns one record per core, with wakeup latencies"
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	/* Cause a few wakeups */
+	Mutex_Lock(&mx);
+	for(int i=0; i<5; i++)
+		Cond_TimedWait(&mx, &cv, 1);
+	Mutex_Unlock(&mx);
+
+	Fid_t fid = OpenSchedInfo();
+	ASSERT(fid!=NOFILE);
+
+	schedinfo info;
+	char small[sizeof(schedinfo)-1];
+	ASSERT(Read(fid, small, sizeof(small))==-1);
+
+	unsigned int ncores = 0;
+	unsigned long wakeups = 0, counted = 0;
+	int rc;
+	while((rc = Read(fid, (char*)&info, sizeof(info))) > 0) {
+		ASSERT(rc == sizeof(info));
+		ASSERT(info.core == ncores);
+		ncores++;
+		wakeups += info.wakeups;
+		for(int i=0; i<SCHEDINFO_BUCKETS; i++)
+			counted += info.latency[i];
+	}
+	ASSERT(rc == 0);
+	ASSERT(ncores == cpu_cores());
+	ASSERT(wakeups >= 5);
+	ASSERT(counted == wakeups);
+
+	ASSERT(Close(fid)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_boot_policy,
+	"Test that the scheduling policy can be selected for the next boot"
+	)
+{
+	ASSERT(boot_policy(SCHED_POLICIES)==-1);
+	ASSERT(boot_policy(-1)==-1);
+
+	int prev = boot_policy(SCHED_POLICY_CFS);
+	ASSERT(prev >= 0 && prev < SCHED_POLICIES);
+	ASSERT(boot_policy(SCHED_POLICY_RR)==SCHED_POLICY_CFS);
+	ASSERT(boot_policy(prev)==SCHED_POLICY_RR);
+	return 0;
+}
+
+
+static int vtime_sleeper(int argl, void* args)
+{
+	TimerDuration* elapsed;
+	memcpy(&elapsed, args, sizeof(elapsed));
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	TimerDuration t0 = bios_clock();
+	Mutex_Lock(&mx);
+	for(int i=0; i<5; i++)
+		ASSERT(Cond_TimedWait(&mx, &cv, 1000)==0);
+	Mutex_Unlock(&mx);
+	*elapsed = bios_clock() - t0;
+	return 0;
+}
+
+BARE_TEST(test_boot_virtual_time,
+	"Test that in virtual time, an idle VM skips ahead to the next timeout"
+	)
+{
+	int prev = boot_virtual_time(1);
+	ASSERT(boot_virtual_time(1)==1);
+
+	TimerDuration elapsed = 0;
+	TimerDuration* elapsed_ptr = &elapsed;
+	struct timeval t0;
+	mark_time(&t0);
+	boot(1, 0, vtime_sleeper, sizeof(elapsed_ptr), &elapsed_ptr);
+	double host = time_since(&t0);
+
+	boot_virtual_time(prev);
+
+	/* The VM clock saw the whole timeout, the host did not */
+	ASSERT(elapsed >= 5000000);
+	ASSERT(host < 2.0);
+}
+
+
+static int rt_waiter(int argl, void* args)
+{
+	volatile int* stop = args;
+	while(! *stop)
+		ASSERT(ThreadWaitPeriod()==0);
+	return 0;
+}
+
+BOOT_TEST(test_rt_create,
+	"Test that real-time threads are checked for valid parameters and admitted up to the utilization limit"
+	)
+{
+	volatile int stop = 0;
+	rtparams half = { .period = 40000, .budget = 10000, .deadline = 20000 };
+	rtparams bad1 = { .period = 40000, .budget = 0, .deadline = 20000 };
+	rtparams bad2 = { .period = 40000, .budget = 30000, .deadline = 20000 };
+	rtparams bad3 = { .period = 10000, .budget = 5000, .deadline = 20000 };
+
+	ASSERT(CreateRealtimeThread(NULL, 0, NULL, &half)==NOTHREAD);
+	ASSERT(CreateRealtimeThread(rt_waiter, 0, (void*)&stop, NULL)==NOTHREAD);
+	ASSERT(CreateRealtimeThread(rt_waiter, 0, (void*)&stop, &bad1)==NOTHREAD);
+	ASSERT(CreateRealtimeThread(rt_waiter, 0, (void*)&stop, &bad2)==NOTHREAD);
+	ASSERT(CreateRealtimeThread(rt_waiter, 0, (void*)&stop, &bad3)==NOTHREAD);
+	ASSERT(ThreadWaitPeriod()==-1);
+
+	/* Each thread reserves half a core */
+	unsigned int admitted = cpu_cores()*RT_UTILIZATION_MAX/50;
+	Tid_t tids[admitted];
+	for(unsigned int i=0; i<admitted; i++) {
+		tids[i] = CreateRealtimeThread(rt_waiter, 0, (void*)&stop, &half);
+		ASSERT(tids[i]!=NOTHREAD);
+	}
+	ASSERT(CreateRealtimeThread(rt_waiter, 0, (void*)&stop, &half)==NOTHREAD);
+
+	/* Exited threads give back their reservation */
+	stop = 1;
+	for(unsigned int i=0; i<admitted; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	Tid_t t = CreateRealtimeThread(rt_waiter, 0, (void*)&stop, &half);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+static int rt_hog(int argl, void* args)
+{
+	volatile int* stop = args;
+	while(! *stop);
+	return 0;
+}
+
+static int rt_periodic(int argl, void* args)
+{
+	for(int i=0; i<argl; i++)
+		ASSERT(ThreadWaitPeriod()==0);
+	return 0;
+}
+
+BOOT_TEST(test_rt_periodic,
+	"Test that a periodic real-time thread meets its deadlines against CPU-bound threads"
+	)
+{
+	volatile int stop = 0;
+	rtparams params = { .period = 100000, .budget = 20000, .deadline = 100000 };
+
+	Tid_t hogs[2*cpu_cores()];
+	for(unsigned int i=0; i<2*cpu_cores(); i++)
+		hogs[i] = CreateThread(rt_hog, 0, (void*)&stop);
+
+	TimerDuration t0 = bios_clock();
+	Tid_t t = CreateRealtimeThread(rt_periodic, 5, NULL, &params);
+	ASSERT(t!=NOTHREAD);
+
+	threadinfo info;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	do {
+		Cond_TimedWait(&mx, &cv, 10);
+		ASSERT(ThreadInfo(t, &info)==0);
+	} while(!info.exited);
+	Mutex_Unlock(&mx);
+	TimerDuration elapsed = bios_clock() - t0;
+
+	stop = 1;
+	for(unsigned int i=0; i<2*cpu_cores(); i++)
+		ASSERT(ThreadJoin(hogs[i], NULL)==0);
+
+	ASSERT(info.jobs == 5);
+	ASSERT(elapsed >= 4*params.period);
+
+	/* 
+	   On an oversubscribed host, a core may lose its processor in the middle 
+	   of a job, and the lost time is charged to the job. 
+	 */
+	if(cpu_cores() <= cpu_physical_cores()) {
+		ASSERT(info.deadline_misses == 0);
+		ASSERT(info.throttles == 0);
+	}
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+static int rt_overrun(int argl, void* args)
+{
+	/* A job that needs far more than its budget */
+	TimerDuration t0 = bios_clock();
+	while(bios_clock() - t0 < 30000);
+	ASSERT(ThreadWaitPeriod()==0);
+	return 0;
+}
+
+BOOT_TEST(test_rt_throttle,
+	"Test that a real-time thread that overruns its budget is throttled and misses its deadline"
+	)
+{
+	rtparams params = { .period = 50000, .budget = 5000, .deadline = 50000 };
+	Tid_t t = CreateRealtimeThread(rt_overrun, 0, NULL, &params);
+	ASSERT(t!=NOTHREAD);
+
+	/* While the thread is throttled, we get to run */
+	threadinfo info;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	do {
+		Cond_TimedWait(&mx, &cv, 10);
+		ASSERT(ThreadInfo(t, &info)==0);
+	} while(!info.exited);
+	Mutex_Unlock(&mx);
+
+	ASSERT(info.throttles >= 1);
+	ASSERT(info.deadline_misses >= 1);
+	ASSERT(info.jobs == 1);
+
+	/* The miss shows in the scheduler info as well */
+	unsigned long misses = 0;
+	schedinfo sinfo;
+	Fid_t fid = OpenSchedInfo();
+	while(Read(fid, (char*)&sinfo, sizeof(sinfo)) == sizeof(sinfo))
+		misses += sinfo.deadline_misses;
+	ASSERT(Close(fid)==0);
+	ASSERT(misses == info.deadline_misses);
+
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_set_stack_size,
+	&test_thread_info_stack_used,
+	&test_thread_affinity,
+	&test_preemption_of_spinning_thread,
+	&test_priority_inheritance,
+	&test_thread_info_accounting,
+	&test_sched_info,
+	&test_boot_policy,
+	&test_boot_virtual_time,
+	&test_rt_create,
+	&test_rt_periodic,
+	&test_rt_throttle,
 	NULL
 };
 